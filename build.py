@@ -89,7 +89,7 @@ def zip_with_msg(zipfile, source, target):
 def collect_binary():
 	for arch in archs:
 		mkdir_p(os.path.join('native', 'out', arch))
-		for bin in ['magisk', 'magiskinit', 'magiskboot', 'busybox', 'b64xz']:
+		for bin in ['magisk', 'magiskinit', 'magiskboot', 'magiskboot_bench', 'busybox', 'b64xz']:
 			source = os.path.join('native', 'libs', arch, bin)
 			target = os.path.join('native', 'out', arch, bin)
 			mv(source, target)
@@ -163,7 +163,8 @@ def build_binary(args):
 		# If nothing specified, build everything
 		args.target = support_targets
 	else:
-		args.target = set(args.target) & support_targets
+		# The benchmark is only built on request
+		args.target = set(args.target) & (support_targets | {'magiskboot_bench'})
 
 	if len(args.target) == 0:
 		return
@@ -209,6 +210,10 @@ def build_binary(args):
 		flags += ' B_BOOT=1'
 		old_plat = True
 
+	if 'magiskboot_bench' in args.target:
+		flags += ' B_BENCH=1'
+		old_plat = True
+
 	if old_plat:
 		proc = system('{} -C native {} -j{}'.format(ndk_build, flags, cpu_count))
 		if proc.returncode != 0:
@@ -381,7 +386,7 @@ def cleanup(args):
 
 	if 'native' in args.target:
 		header('* Cleaning native')
-		system(ndk_build + ' -C native B_MAGISK=1 B_INIT=1 B_BOOT=1 B_BXZ=1 B_BB=1 clean')
+		system(ndk_build + ' -C native B_MAGISK=1 B_INIT=1 B_BOOT=1 B_BENCH=1 B_BXZ=1 B_BB=1 clean')
 		shutil.rmtree(os.path.join('native', 'out'), ignore_errors=True)
 
 	if 'java' in args.target:
@@ -407,7 +412,7 @@ all_parser = subparsers.add_parser('all', help='build everything (binaries/apks/
 all_parser.set_defaults(func=build_all)
 
 binary_parser = subparsers.add_parser('binary', help='build binaries')
-binary_parser.add_argument('target', nargs='*', help='Support: magisk, magiskinit, magiskboot, busybox, b64xz. Leave empty to build all.')
+binary_parser.add_argument('target', nargs='*', help='Support: magisk, magiskinit, magiskboot, magiskboot_bench, busybox, b64xz. Leave empty to build all but magiskboot_bench.')
 binary_parser.set_defaults(func=build_binary)
 
 apk_parser = subparsers.add_parser('apk', help='build Magisk Manager APK')
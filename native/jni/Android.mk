@@ -12,6 +12,7 @@ LIBFDT := $(EXT_PATH)/dtc/libfdt
 LIBNANOPB := $(EXT_PATH)/nanopb
 LIBSYSTEMPROPERTIES := jni/systemproperties/include
 LIBUTILS := jni/utils/include
+LIBMAGISKBOOT := jni/magiskboot/include
 
 ########################
 # Binaries
@@ -89,7 +90,7 @@ ifdef B_BOOT
 # magiskboot
 include $(CLEAR_VARS)
 LOCAL_MODULE := magiskboot
-LOCAL_STATIC_LIBRARIES := libmincrypt liblzma liblz4 libbz2 libfdt libutils
+LOCAL_STATIC_LIBRARIES := libmagiskboot libmincrypt liblzma liblz4 libbz2 libfdt libutils
 LOCAL_C_INCLUDES := \
 	jni/include \
 	$(EXT_PATH)/include \
@@ -99,16 +100,29 @@ LOCAL_C_INCLUDES := \
 	$(LIBFDT) \
 	$(LIBUTILS)
 
-LOCAL_SRC_FILES := \
-	magiskboot/main.cpp \
-	magiskboot/cpio.cpp \
-	magiskboot/bootimg.cpp \
-	magiskboot/hexpatch.cpp \
-	magiskboot/compress.cpp \
-	magiskboot/format.cpp \
-	magiskboot/dtb.cpp \
-	magiskboot/ramdisk.cpp \
-	magiskboot/pattern.cpp
+LOCAL_SRC_FILES := magiskboot/main.cpp
+
+LOCAL_LDLIBS := -lz
+include $(BUILD_EXECUTABLE)
+
+endif
+
+ifdef B_BENCH
+
+# magiskboot_bench
+include $(CLEAR_VARS)
+LOCAL_MODULE := magiskboot_bench
+LOCAL_STATIC_LIBRARIES := libmagiskboot libmincrypt liblzma liblz4 libbz2 libfdt libutils
+LOCAL_C_INCLUDES := \
+	jni/include \
+	$(EXT_PATH)/include \
+	$(LIBLZMA) \
+	$(LIBLZ4) \
+	$(LIBBZ2) \
+	$(LIBFDT) \
+	$(LIBUTILS)
+
+LOCAL_SRC_FILES := magiskboot/bench.cpp
 
 LOCAL_LDLIBS := -lz
 include $(BUILD_EXECUTABLE)
@@ -139,5 +153,6 @@ endif
 # Libraries
 ########################
 include jni/utils/Android.mk
+include jni/magiskboot/Android.mk
 include jni/systemproperties/Android.mk
 include jni/external/Android.mk
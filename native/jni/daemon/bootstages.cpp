@@ -547,7 +547,6 @@ void unlock_blocks() {
 
 static void unblock_boot_process() {
 	close(xopen(UNBLOCKFILE, O_RDONLY | O_CREAT, 0));
-	pthread_exit(nullptr);
 }
 
 static const char wrapper[] =
@@ -558,8 +557,10 @@ static const char wrapper[] =
 
 void startup() {
 	android_logging();
-	if (!check_data())
+	if (!check_data()) {
 		unblock_boot_process();
+		return;
+	}
 
 	if (access(SECURE_DIR, F_OK) != 0) {
 		/* If the folder is not automatically created by the system,
@@ -567,6 +568,7 @@ void startup() {
 		 * will cause bootloops on FBE devices. */
 		LOGE(SECURE_DIR" is not present, abort...");
 		unblock_boot_process();
+		return;
 	}
 
 #if 0
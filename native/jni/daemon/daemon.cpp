@@ -5,12 +5,14 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/mount.h>
 
@@ -29,34 +31,135 @@ static void get_client_cred(int fd, struct ucred *cred) {
 		PLOGE("getsockopt");
 }
 
-static void *request_handler(void *args) {
-	int client = *((int *) args);
-	delete (int *) args;
-	int req = read_int(client);
+/* Requests that can block for long run on a few workers. While all are busy
+ * requests queue up. Requests that do not fit in the queue wait in the main
+ * loop, which meanwhile stops accepting: new clients wait in the backlog */
+#define MAX_WORKERS  4
+#define QUEUE_SIZE   32
 
+struct request {
+	int client;
+	int req;
 	struct ucred credential;
-	get_client_cred(client, &credential);
+};
 
-	switch (req) {
+static request req_queue[QUEUE_SIZE];
+static int queue_head = 0;
+static int queue_len = 0;
+static int workers = 0;
+static int idle_workers = 0;
+// Set when the queue was full, a worker taking a request then wakes the main loop
+static bool throttled = false;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+
+// Only the main loop uses these, processes forked by the daemon close them
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static int wake_fd[2] = { -1, -1 };
+static bool listening = false;
+static Array<request> parked;
+
+// A client accepted by the main loop, until all of its request is read
+struct pending_client {
+	int fd;
+	size_t len;
+	uint8_t buf[sizeof(int)];
+};
+
+static void handle_blocking(request &r) {
+	switch (r.req) {
+	case MAGISKHIDE:
+		magiskhide_handler(r.client);
+		break;
+	case SUPERUSER:
+		su_daemon_handler(r.client, &r.credential);
+		break;
+	case POST_FS_DATA:
+		post_fs_data(r.client);
+		break;
+	case LATE_START:
+		late_start(r.client);
+		break;
+	case BOOT_COMPLETE:
+		boot_complete(r.client);
+		break;
+	}
+}
+
+static void *worker(void *) {
+	while (true) {
+		pthread_mutex_lock(&queue_lock);
+		++idle_workers;
+		while (queue_len == 0)
+			pthread_cond_wait(&queue_not_empty, &queue_lock);
+		--idle_workers;
+		request r = req_queue[queue_head];
+		queue_head = (queue_head + 1) % QUEUE_SIZE;
+		--queue_len;
+		bool wake = throttled;
+		throttled = false;
+		pthread_mutex_unlock(&queue_lock);
+
+		if (wake)
+			write(wake_fd[1], "", 1);
+		handle_blocking(r);
+	}
+	return nullptr;
+}
+
+/* Returns false if the queue is full.
+ * Workers are only started when all others are busy, and then never exit */
+static bool queue_request(const request &r) {
+	pthread_mutex_lock(&queue_lock);
+	if (queue_len == QUEUE_SIZE) {
+		throttled = true;
+		pthread_mutex_unlock(&queue_lock);
+		return false;
+	}
+	req_queue[(queue_head + queue_len) % QUEUE_SIZE] = r;
+	++queue_len;
+	if (queue_len > idle_workers && workers < MAX_WORKERS) {
+		pthread_t thread;
+		xpthread_create(&thread, nullptr, worker, nullptr);
+		pthread_detach(thread);
+		++workers;
+	}
+	pthread_cond_signal(&queue_not_empty);
+	pthread_mutex_unlock(&queue_lock);
+	return true;
+}
+
+// Called once the request of client is read, short requests are handled right away
+static void request_handler(int client, int req) {
+	request r;
+	r.client = client;
+	r.req = req;
+	get_client_cred(client, &r.credential);
+
+	switch (r.req) {
 	case MAGISKHIDE:
 	case POST_FS_DATA:
 	case LATE_START:
 	case BOOT_COMPLETE:
-		if (credential.uid != 0) {
+		if (r.credential.uid != 0) {
 			write_int(client, ROOT_REQUIRED);
 			close(client);
-			return NULL;
+			return;
 		}
 	default:
 		break;
 	}
 
-	switch (req) {
+	switch (r.req) {
 	case MAGISKHIDE:
-		magiskhide_handler(client);
-		break;
 	case SUPERUSER:
-		su_daemon_handler(client, &credential);
+	case POST_FS_DATA:
+	case LATE_START:
+	case BOOT_COMPLETE:
+		// Requests are taken in order, none may pass the parked ones
+		if (!parked.empty() || !queue_request(r))
+			parked.push_back(r);
 		break;
 	case CHECK_VERSION:
 		write_string(client, xstr(MAGISK_VERSION) ":MAGISK");
@@ -66,15 +169,6 @@ static void *request_handler(void *args) {
 		write_int(client, MAGISK_VER_CODE);
 		close(client);
 		break;
-	case POST_FS_DATA:
-		post_fs_data(client);
-		break;
-	case LATE_START:
-		late_start(client);
-		break;
-	case BOOT_COMPLETE:
-		boot_complete(client);
-		break;
 	case HANDSHAKE:
 		/* Do NOT close the client, make it hold */
 		break;
@@ -82,7 +176,55 @@ static void *request_handler(void *args) {
 		close(client);
 		break;
 	}
-	return nullptr;
+}
+
+static void watch(int fd, void *ptr) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = ptr;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Queue what has been parked, and only accept new clients if that is all done
+static void update_listen() {
+	while (!parked.empty() && queue_request(parked[0]))
+		parked.pop_front();
+	bool full = !parked.empty();
+	if (full && listening)
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+	else if (!full && !listening)
+		watch(listen_fd, &listen_fd);
+	listening = !full;
+}
+
+/* Clients are read without blocking, so one that is slow to send its
+ * request does not hold up the others. The rest is up to the handlers */
+static void read_request(pending_client *c) {
+	ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0) {
+		c->len += n;
+		if (c->len < sizeof(c->buf))
+			return;
+	}
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	if (n > 0) {
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+		int req;
+		memcpy(&req, c->buf, sizeof(req));
+		request_handler(c->fd, req);
+	} else {
+		close(c->fd);
+	}
+	delete c;
+}
+
+static void close_loop_fds() {
+	close(listen_fd);
+	close(epoll_fd);
+	close(wake_fd[0]);
+	close(wake_fd[1]);
 }
 
 static void main_daemon() {
@@ -99,10 +241,10 @@ static void main_daemon() {
 
 	struct sockaddr_un sun;
 	socklen_t len = setup_sockaddr(&sun, MAIN_SOCKET);
-	fd = xsocket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if (xbind(fd, (struct sockaddr*) &sun, len))
+	listen_fd = xsocket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (xbind(listen_fd, (struct sockaddr*) &sun, len))
 		exit(1);
-	xlisten(fd, 10);
+	xlisten(listen_fd, 10);
 	LOGI("Magisk v" xstr(MAGISK_VERSION) "(" xstr(MAGISK_VER_CODE) ") daemon started\n");
 
 	// Change process name
@@ -121,14 +263,40 @@ static void main_daemon() {
 	act.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &act, NULL);
 
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		PLOGE("epoll_create1");
+		exit(1);
+	}
+	xpipe2(wake_fd, O_CLOEXEC | O_NONBLOCK);
+	watch(wake_fd[0], wake_fd);
+	update_listen();
+	pthread_atfork(nullptr, nullptr, close_loop_fds);
+
 	// Loop forever to listen for requests
+	struct epoll_event events[16];
 	while(1) {
-		int *client = new int;
-		*client = xaccept4(fd, NULL, NULL, SOCK_CLOEXEC);
-		pthread_t thread;
-		xpthread_create(&thread, NULL, request_handler, client);
-		// Detach the thread, we will never join it
-		pthread_detach(thread);
+		int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+		for (int i = 0; i < n; ++i) {
+			void *ptr = events[i].data.ptr;
+			if (ptr == &listen_fd) {
+				// It may have been removed by an earlier event
+				if (!listening)
+					continue;
+				int client = xaccept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+				if (client < 0)
+					continue;
+				auto c = new pending_client();
+				c->fd = client;
+				watch(client, c);
+			} else if (ptr == wake_fd) {
+				char buf[16];
+				while (read(wake_fd[0], buf, sizeof(buf)) > 0);
+			} else {
+				read_request(static_cast<pending_client *>(ptr));
+			}
+			update_listen();
+		}
 	}
 }
 
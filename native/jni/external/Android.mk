@@ -24,9 +24,25 @@ LOCAL_SRC_FILES := \
 	xz-embedded/xz_dec_stream.c
 include $(BUILD_STATIC_LIBRARY)
 
+# libmincrypt_hw.a
+# Built for the ARMv8 Crypto Extensions, only used when the CPU has them
+include $(CLEAR_VARS)
+LOCAL_MODULE:= libmincrypt_hw
+LOCAL_C_INCLUDES := $(EXT_PATH)/include
+LOCAL_SRC_FILES := mincrypt/sha_hw.c
+ifeq ($(TARGET_ARCH_ABI),arm64-v8a)
+LOCAL_CFLAGS := -march=armv8-a+crypto
+endif
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_ARM_MODE := arm
+LOCAL_CFLAGS := -march=armv8-a -mfpu=crypto-neon-fp-armv8
+endif
+include $(BUILD_STATIC_LIBRARY)
+
 # libmincrypt.a
 include $(CLEAR_VARS)
 LOCAL_MODULE:= libmincrypt
+LOCAL_STATIC_LIBRARIES := libmincrypt_hw
 LOCAL_C_INCLUDES := $(EXT_PATH)/include
 LOCAL_SRC_FILES := \
 	mincrypt/dsa_sig.c \
@@ -0,0 +1,279 @@
+/* sha_hw.c - SHA-1 and SHA-256 with x86 SHA-NI or ARMv8 Crypto Extensions
+ *
+ * Only the compression function is implemented here, buffering and padding
+ * stay in sha.c and sha256.c. Message words are loaded big endian.
+ *
+ * On ARM this file is built for ARMv8 with the Crypto Extensions, also on
+ * armeabi-v7a, so nothing else may live here: apart from probing the CPU,
+ * none of it runs on a CPU without them.
+ */
+
+#include "sha_hw.h"
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA_NI __attribute__((target("sha,sse4.1,ssse3")))
+
+// Rounds 4g to 4g+3 with round function f, W holds the last 4 message vectors
+#define SHA1_GROUP(g, f) do { \
+    if (g >= 4) \
+        W[g % 4] = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(W[g % 4], \
+                W[(g + 1) % 4]), W[(g + 2) % 4]), W[(g + 3) % 4]); \
+    E = g ? _mm_sha1nexte_epu32(E_prev, W[g % 4]) : _mm_add_epi32(E, W[0]); \
+    E_prev = ABCD; \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E, f); \
+} while (0)
+
+SHA_NI static void sha1_blocks_shani(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1B);
+    __m128i E0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i W[4], E, E_prev;
+    int g;
+
+    while (blocks--) {
+        __m128i ABCD_SAVE = ABCD;
+        E = E0;
+        for (g = 0; g < 4; ++g)
+            W[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + g * 16)), MASK);
+        for (g = 0; g < 5; ++g)
+            SHA1_GROUP(g, 0);
+        for (; g < 10; ++g)
+            SHA1_GROUP(g, 1);
+        for (; g < 15; ++g)
+            SHA1_GROUP(g, 2);
+        for (; g < 20; ++g)
+            SHA1_GROUP(g, 3);
+        E0 = _mm_sha1nexte_epu32(E_prev, E0);
+        ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*) state, _mm_shuffle_epi32(ABCD, 0x1B));
+    state[4] = _mm_extract_epi32(E0, 3);
+}
+
+SHA_NI static void sha256_blocks_shani(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    // The instructions want the state as ABEF and CDGH
+    __m128i TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xB1);
+    __m128i STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1B);
+    __m128i STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+    __m128i W[4], MSG;
+    int g;
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);
+
+    while (blocks--) {
+        __m128i ABEF_SAVE = STATE0, CDGH_SAVE = STATE1;
+        for (g = 0; g < 4; ++g)
+            W[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + g * 16)), MASK);
+        for (g = 0; g < 16; ++g) {
+            MSG = _mm_add_epi32(W[g % 4], _mm_loadu_si128((const __m128i*) &K256[g * 4]));
+            STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+            STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, _mm_shuffle_epi32(MSG, 0x0E));
+            // Finish the next message vector, it needs the previous one intact
+            if (g >= 3 && g < 15) {
+                TMP = _mm_alignr_epi8(W[g % 4], W[(g + 3) % 4], 4);
+                W[(g + 1) % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(W[(g + 1) % 4], TMP), W[g % 4]);
+            }
+            // Then start on the one needed three groups later
+            if (g >= 1 && g <= 12)
+                W[(g + 3) % 4] = _mm_sha256msg1_epu32(W[(g + 3) % 4], W[g % 4]);
+        }
+        STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+        STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+        data += 64;
+    }
+
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B);
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+    _mm_storeu_si128((__m128i*) &state[0], _mm_blend_epi16(TMP, STATE1, 0xF0));
+    _mm_storeu_si128((__m128i*) &state[4], _mm_alignr_epi8(STATE1, TMP, 8));
+}
+
+static int has_shani(void) {
+    unsigned a, b, c, d;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid(1, a, b, c, d);
+    // SSSE3 and SSE4.1
+    if ((c & (1 << 9)) == 0 || (c & (1 << 19)) == 0)
+        return 0;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b >> 29) & 1;
+}
+
+sha_blocks_fn sha1_hw_blocks(void) {
+    return has_shani() ? sha1_blocks_shani : NULL;
+}
+
+sha_blocks_fn sha256_hw_blocks(void) {
+    return has_shani() ? sha256_blocks_shani : NULL;
+}
+
+#elif (defined(__aarch64__) || defined(__arm__)) && \
+        (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+
+#include <arm_neon.h>
+
+#if defined(__aarch64__)
+
+#include <sys/auxv.h>
+
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+
+static int has_sha1(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+
+static int has_sha2(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define AUX_HWCAP2 26
+#define HWCAP2_SHA1 (1 << 2)
+#define HWCAP2_SHA2 (1 << 3)
+
+// API 16 has no getauxval, read the auxiliary vector of the process instead
+static unsigned long hwcap2(void) {
+    unsigned long aux[2], val = 0;
+    int fd = open("/proc/self/auxv", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    while (read(fd, aux, sizeof(aux)) == sizeof(aux) && aux[0] != 0) {
+        if (aux[0] == AUX_HWCAP2) {
+            val = aux[1];
+            break;
+        }
+    }
+    close(fd);
+    return val;
+}
+
+static int has_sha1(void) {
+    return (hwcap2() & HWCAP2_SHA1) != 0;
+}
+
+static int has_sha2(void) {
+    return (hwcap2() & HWCAP2_SHA2) != 0;
+}
+
+#endif
+
+static inline uint32x4_t load_be(const uint8_t* p) {
+    return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)));
+}
+
+static void sha1_blocks_ce(uint32_t* state, const uint8_t* data, size_t blocks) {
+    static const uint32_t K1[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    uint32x4_t ABCD = vld1q_u32(state);
+    uint32_t E0 = state[4];
+    uint32x4_t W[4];
+    int g;
+
+    while (blocks--) {
+        uint32x4_t ABCD_SAVE = ABCD;
+        uint32_t E = E0, E_next;
+        for (g = 0; g < 4; ++g)
+            W[g] = load_be(data + g * 16);
+        for (g = 0; g < 20; ++g) {
+            if (g >= 4)
+                W[g % 4] = vsha1su1q_u32(vsha1su0q_u32(W[g % 4], W[(g + 1) % 4],
+                        W[(g + 2) % 4]), W[(g + 3) % 4]);
+            uint32x4_t MSG = vaddq_u32(W[g % 4], vdupq_n_u32(K1[g / 5]));
+            E_next = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+            if (g < 5)
+                ABCD = vsha1cq_u32(ABCD, E, MSG);
+            else if (g >= 10 && g < 15)
+                ABCD = vsha1mq_u32(ABCD, E, MSG);
+            else
+                ABCD = vsha1pq_u32(ABCD, E, MSG);
+            E = E_next;
+        }
+        E0 += E;
+        ABCD = vaddq_u32(ABCD, ABCD_SAVE);
+        data += 64;
+    }
+
+    vst1q_u32(state, ABCD);
+    state[4] = E0;
+}
+
+static void sha256_blocks_ce(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t STATE0 = vld1q_u32(&state[0]);
+    uint32x4_t STATE1 = vld1q_u32(&state[4]);
+    uint32x4_t W[4];
+    int g;
+
+    while (blocks--) {
+        uint32x4_t ABCD_SAVE = STATE0, EFGH_SAVE = STATE1;
+        for (g = 0; g < 4; ++g)
+            W[g] = load_be(data + g * 16);
+        for (g = 0; g < 16; ++g) {
+            if (g >= 4)
+                W[g % 4] = vsha256su1q_u32(vsha256su0q_u32(W[g % 4], W[(g + 1) % 4]),
+                        W[(g + 2) % 4], W[(g + 3) % 4]);
+            uint32x4_t MSG = vaddq_u32(W[g % 4], vld1q_u32(&K256[g * 4]));
+            uint32x4_t TMP = STATE0;
+            STATE0 = vsha256hq_u32(STATE0, STATE1, MSG);
+            STATE1 = vsha256h2q_u32(STATE1, TMP, MSG);
+        }
+        STATE0 = vaddq_u32(STATE0, ABCD_SAVE);
+        STATE1 = vaddq_u32(STATE1, EFGH_SAVE);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], STATE0);
+    vst1q_u32(&state[4], STATE1);
+}
+
+sha_blocks_fn sha1_hw_blocks(void) {
+    return has_sha1() ? sha1_blocks_ce : NULL;
+}
+
+sha_blocks_fn sha256_hw_blocks(void) {
+    return has_sha2() ? sha256_blocks_ce : NULL;
+}
+
+#else
+
+sha_blocks_fn sha1_hw_blocks(void) {
+    return NULL;
+}
+
+sha_blocks_fn sha256_hw_blocks(void) {
+    return NULL;
+}
+
+#endif
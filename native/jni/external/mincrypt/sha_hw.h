@@ -0,0 +1,17 @@
+/* sha_hw.h - SHA instruction set extensions, selected at runtime
+ */
+
+#ifndef MINCRYPT_SHA_HW_H_
+#define MINCRYPT_SHA_HW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Process blocks of 64 bytes from data into state
+typedef void (*sha_blocks_fn)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+// The accelerated block function if the CPU supports it, NULL otherwise
+sha_blocks_fn sha1_hw_blocks(void);
+sha_blocks_fn sha256_hw_blocks(void);
+
+#endif  // MINCRYPT_SHA_HW_H_
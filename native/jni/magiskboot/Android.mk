@@ -0,0 +1,32 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE:= libmagiskboot
+LOCAL_STATIC_LIBRARIES := libmincrypt liblzma liblz4 libbz2 libfdt libutils
+LOCAL_C_INCLUDES := \
+	jni/include \
+	$(EXT_PATH)/include \
+	$(LIBLZMA) \
+	$(LIBLZ4) \
+	$(LIBBZ2) \
+	$(LIBFDT) \
+	$(LIBUTILS) \
+	$(LIBMAGISKBOOT)
+LOCAL_SRC_FILES := \
+	libmagiskboot.cpp \
+	cpio.cpp \
+	bootimg.cpp \
+	batch.cpp \
+	hexpatch.cpp \
+	compress.cpp \
+	inflate.cpp \
+	format.cpp \
+	dtb.cpp \
+	ramdisk.cpp \
+	pattern.cpp \
+	parallel.cpp \
+	profile.cpp \
+	sparse.cpp \
+	stream.cpp
+
+include $(BUILD_STATIC_LIBRARY)
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "magiskboot.h"
+#include "parallel.h"
+#include "utils.h"
+#include "logging.h"
+
+struct batch_job {
+	const char *in;
+	const char *out;
+	Array<char *> cmds;
+	int ret;
+	long ms;
+};
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void json_str(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void report(size_t i, batch_job &job, const char *error) {
+	pthread_mutex_lock(&report_lock);
+	printf("{\"job\":%zu,\"in\":", i);
+	json_str(stdout, job.in);
+	printf(",\"out\":");
+	json_str(stdout, job.out);
+	printf(",\"status\":%d,\"ms\":%ld", job.ret, job.ms);
+	if (error) {
+		printf(",\"error\":");
+		json_str(stdout, error);
+	}
+	printf("}\n");
+	fflush(stdout);
+	pthread_mutex_unlock(&report_lock);
+}
+
+static long now_ms() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void run_job(size_t i, batch_job &job) {
+	if (access(job.in, R_OK) != 0) {
+		job.ret = 1;
+		report(i, job, "cannot read input image");
+		return;
+	}
+	// Errors in the image only fail this job
+	job_error err {};
+	soft_errors = &err;
+	long start = now_ms();
+	job.ret = patch(job.in, job.out, job.cmds.size(), job.cmds.data());
+	job.ms = now_ms() - start;
+	soft_errors = nullptr;
+	for (char *end = err.msg + strlen(err.msg); end > err.msg && end[-1] == '\n'; --end)
+		end[-1] = '\0';
+	if (err.set)
+		report(i, job, err.msg);
+	else
+		report(i, job, job.ret < 0 ? "unknown cpio command" : nullptr);
+}
+
+/* Every line of the manifest is one job: <inbootimg> <outbootimg> followed by
+ * cpio commands separated by ';'. Jobs run on up to get_threads() workers, the
+ * threads left over are shared among the compressors of the running jobs. */
+int batch(const char *manifest) {
+	Array<CharArray> lines;
+	Array<batch_job> jobs;
+	if (file_to_array(manifest, lines))
+		LOGE("Cannot read manifest [%s]\n", manifest);
+	for (auto &line : lines) {
+		char *save;
+		batch_job job {};
+		job.in = strtok_r(line, " \t\r", &save);
+		if (job.in == nullptr || job.in[0] == '#')
+			continue;
+		job.out = strtok_r(nullptr, " \t\r", &save);
+		if (job.out == nullptr)
+			LOGE("No output image for [%s]\n", job.in);
+		for (char *cmd; (cmd = strtok_r(nullptr, ";", &save));) {
+			// ramdisk_commands splits on single spaces, trim the rest
+			cmd += strspn(cmd, " \t");
+			for (char *end = cmd + strlen(cmd); end > cmd && strchr(" \t\r", end[-1]); --end)
+				end[-1] = '\0';
+			if (*cmd)
+				job.cmds.push_back(cmd);
+		}
+		jobs.push_back(job);
+	}
+	if (jobs.size() == 0)
+		return 0;
+
+	int threads = get_threads();
+	int workers = threads < (int) jobs.size() ? threads : jobs.size();
+	int share = threads / workers;
+	fprintf(stderr, "Batch: %zu jobs on %d workers\n", jobs.size(), workers);
+
+	int failed = 0;
+	int budget = thread_budget;
+	parallel_for(jobs.size(), [&](size_t i) {
+		thread_budget = share;
+		run_job(i, jobs[i]);
+		if (jobs[i].ret)
+			__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+	});
+	thread_budget = budget;
+	return failed;
+}
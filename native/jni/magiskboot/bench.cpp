@@ -0,0 +1,454 @@
+/* bench.cpp - Benchmark magiskboot on synthetic boot images
+ *
+ * Images are generated in memory, then every stage is timed on them. Each
+ * result is printed to stdout as one JSON object per line; the fastest of
+ * all runs is reported, together with the peak RSS seen during the runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libfdt.h>
+#include <sys/stat.h>
+
+#include <mincrypt/sha256.h>
+
+#include "bootimg.h"
+#include "cpio.h"
+#include "magiskboot.h"
+#include "parallel.h"
+#include "profile.h"
+#include "utils.h"
+#include "logging.h"
+
+static int runs = 3;
+static int entries = 1000;
+static size_t kernel_size = 16 << 20;
+static int dtb_count = 8;
+static bool verbose = false;
+
+static void usage(char *arg0) {
+	fprintf(stderr,
+		"Usage: %s [options...]\n"
+		"\n"
+		"Options:\n"
+		"  --threads=N    Use at most N threads (default: one per CPU)\n"
+		"  --runs=N       Time every stage N times, the fastest run counts (default: 3)\n"
+		"  --entries=N    Files in the generated ramdisk (default: 1000)\n"
+		"  --kernel=MB    Size of the generated kernel (default: 16)\n"
+		"  --dtbs=N       DTBs appended to the kernel (default: 8)\n"
+		"  --dir=DIR      Working directory (default: $TMPDIR or /data/local/tmp)\n"
+		"  -v             Keep the output of magiskboot\n"
+		"\n", arg0);
+	exit(1);
+}
+
+/*******************
+ * Measurements
+ *******************/
+
+static int saved_stderr = -1;
+
+// Everything magiskboot prints would end up in the measurements
+static void quiet(bool on) {
+	if (verbose)
+		return;
+	if (on) {
+		saved_stderr = dup(STDERR_FILENO);
+		int fd = xopen("/dev/null", O_WRONLY | O_CLOEXEC);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	} else {
+		dup2(saved_stderr, STDERR_FILENO);
+		close(saved_stderr);
+	}
+}
+
+static double now_ms() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Time fn, which returns the number of bytes it produced, and report it.
+ * prepare runs before every run and is not timed */
+template <class P, class F>
+static void bench(const char *stage, const char *name, size_t in, P prepare, F fn) {
+	double best = 0;
+	size_t out = 0;
+	long rss = 0;
+	for (int i = 0; i < runs; ++i) {
+		quiet(true);
+		prepare();
+		reset_peak_rss();
+		double start = now_ms();
+		out = fn();
+		double ms = now_ms() - start;
+		quiet(false);
+		long peak = peak_rss_kb();
+		if (i == 0 || ms < best)
+			best = ms;
+		if (peak > rss)
+			rss = peak;
+	}
+	printf("{\"stage\":\"%s\",\"name\":\"%s\",\"bytes_in\":%zu,\"bytes_out\":%zu,"
+			"\"ms\":%.3f,\"mb_s\":%.2f,\"peak_rss_kb\":%ld}\n",
+			stage, name, in, out, best, best > 0 ? in / 1048576.0 / (best / 1000.0) : 0.0, rss);
+	fflush(stdout);
+}
+
+template <class F>
+static void bench(const char *stage, const char *name, size_t in, F fn) {
+	bench(stage, name, in, []{}, fn);
+}
+
+/*******************
+ * Synthetic images
+ *******************/
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t rand32() {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+// Text-like data made of a small vocabulary, which compresses about as well as a kernel
+static void gen_blob(out_stream &os, size_t size) {
+	static char words[256][8];
+	static bool init = false;
+	if (!init) {
+		for (auto &w : words) {
+			for (auto &c : w)
+				c = 'a' + rand32() % 16;
+		}
+		init = true;
+	}
+	uint8_t buf[4096];
+	for (size_t left = size; left;) {
+		size_t len = 0;
+		while (len < sizeof(buf) - 12) {
+			uint32_t r = rand32();
+			memcpy(buf + len, words[r & 0xff], 2 + (r >> 8) % 7);
+			len += 2 + (r >> 8) % 7;
+			// Some incompressible bytes, like tables and code
+			if ((r >> 16) % 10 < 3) {
+				uint32_t noise = rand32();
+				memcpy(buf + len, &noise, 4);
+				len += 4;
+			}
+		}
+		len = len < left ? len : left;
+		os.write(buf, len);
+		left -= len;
+	}
+}
+
+#define FSTAB_CONTENT \
+	"/dev/block/system /system ext4 ro wait,verify=/dev/block/metadata\n" \
+	"/dev/block/userdata /data ext4 noatime wait,forceencrypt=footer\n"
+
+static void add_file(cpio *rd, const char *name, mode_t mode, const void *data, size_t size) {
+	auto e = new cpio_entry();
+	e->filename = name;
+	e->mode = mode;
+	e->filesize = size;
+	if (size) {
+		e->data = xmalloc(size);
+		memcpy(e->data, data, size);
+	}
+	rd->insert(e);
+}
+
+static void gen_ramdisk(buf_stream &os) {
+	cpio *rd = load_ramdisk(nullptr, 0);
+	buf_stream init;
+	gen_blob(init, 1 << 20);
+	add_file(rd, "init", S_IFREG | 0750, init.data(), init.size());
+	add_file(rd, "fstab.qcom", S_IFREG | 0640, FSTAB_CONTENT, sizeof(FSTAB_CONTENT) - 1);
+	add_file(rd, "verity_key", S_IFREG | 0644, "KEY", 3);
+	add_file(rd, "sbin", S_IFDIR | 0750, nullptr, 0);
+	char name[32];
+	for (int i = 0; i < entries; ++i) {
+		buf_stream data;
+		gen_blob(data, rand32() % 8192);
+		sprintf(name, "sbin/f%05d", i);
+		add_file(rd, name, S_IFREG | 0644, data.data(), data.size());
+	}
+	rd->dump(os);
+	delete rd;
+}
+
+// DTBs with an fstab carrying verity flags, like on devices with early mount
+static void gen_dtbs(buf_stream &os) {
+	static const char flags[] = "wait,verify,slotselect";
+	static const char *parts[] = { "system", "vendor" };
+	size_t size = 8192;
+	void *fdt = xmalloc(size);
+	for (int i = 0; i < dtb_count; ++i) {
+		fdt_create(fdt, size);
+		fdt_finish_reservemap(fdt);
+		fdt_begin_node(fdt, "");
+		fdt_begin_node(fdt, "firmware");
+		fdt_begin_node(fdt, "android");
+		fdt_begin_node(fdt, "fstab");
+		for (const char *part : parts) {
+			fdt_begin_node(fdt, part);
+			fdt_property(fdt, "fsmgr_flags", flags, sizeof(flags));
+			fdt_end_node(fdt);
+		}
+		fdt_end_node(fdt);
+		fdt_end_node(fdt);
+		fdt_end_node(fdt);
+		fdt_end_node(fdt);
+		fdt_finish(fdt);
+		os.write(fdt, fdt_totalsize(fdt));
+	}
+	free(fdt);
+}
+
+static void pad(buf_stream &os, size_t base, size_t align) {
+	static const uint8_t zeros[4096] = { 0 };
+	os.write(zeros, align_off(os.size() - base, align));
+}
+
+enum { IMG_AOSP, IMG_MTK, IMG_DHTB };
+
+static void write_section(buf_stream &os, size_t base, bool mtk, const char *name,
+		const buf_stream &data) {
+	if (mtk) {
+		uint8_t block[512] = { 0 };
+		auto hdr = (mtk_hdr *) block;
+		memcpy(&hdr->magic, MTK_MAGIC, 4);
+		hdr->size = data.size();
+		strcpy(hdr->name, name);
+		os.write(block, sizeof(block));
+	}
+	os.write(data.data(), data.size());
+	pad(os, base, 2048);
+}
+
+static void gen_image(buf_stream &os, int type, const buf_stream &kernel, const buf_stream &ramdisk) {
+	bool mtk = type == IMG_MTK;
+	if (type == IMG_DHTB) {
+		uint8_t block[512] = { 0 };
+		os.write(block, sizeof(block));
+	}
+	size_t base = os.size();
+	boot_img_hdr hdr {};
+	memcpy(hdr.magic, BOOT_MAGIC, 8);
+	hdr.kernel_size = kernel.size() + (mtk ? 512 : 0);
+	hdr.kernel_addr = 0x10008000;
+	hdr.ramdisk_size = ramdisk.size() + (mtk ? 512 : 0);
+	hdr.ramdisk_addr = 0x11000000;
+	hdr.tags_addr = 0x10000100;
+	hdr.page_size = 2048;
+	strcpy(hdr.name, "bench");
+	strcpy(hdr.cmdline, "console=ttyMSM0,115200n8 androidboot.hardware=qcom");
+	os.write(&hdr, sizeof(boot_img_hdr_v0));
+	pad(os, base, 2048);
+	write_section(os, base, mtk, "KERNEL", kernel);
+	write_section(os, base, mtk, "ROOTFS", ramdisk);
+	if (type == IMG_DHTB) {
+		os.write(SEANDROID_MAGIC "\xFF\xFF\xFF\xFF", 20);
+		auto dhtb = (dhtb_hdr *) os.data();
+		memcpy(dhtb->magic, DHTB_MAGIC, 8);
+		dhtb->size = os.size() - 512;
+		SHA256_hash(os.data() + 512, dhtb->size, dhtb->checksum);
+	}
+}
+
+/*******************
+ * Stages
+ *******************/
+
+static void dump_file(const char *file, const void *buf, size_t size) {
+	int fd = xopen(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	xwrite(fd, buf, size);
+	close(fd);
+}
+
+static size_t file_size(const char *file) {
+	struct stat st;
+	return stat(file, &st) == 0 ? st.st_size : 0;
+}
+
+static void bench_image(const char *name, int type, const buf_stream &kernel,
+		const buf_stream &ramdisk) {
+	buf_stream img;
+	gen_image(img, type, kernel, ramdisk);
+	char file[64];
+	sprintf(file, "%s.img", name);
+	dump_file(file, img.data(), img.size());
+
+	bench("unpack", name, img.size(), [&] {
+		unpack(file);
+		return file_size(KERNEL_FILE) + file_size(DTB_FILE) + file_size(RAMDISK_FILE);
+	});
+	bench("repack", name, img.size(), [&] {
+		repack(file, NEW_BOOT);
+		return file_size(NEW_BOOT);
+	});
+	// Without the record of unpack, everything is compressed again
+	bench("repack_full", name, img.size(), [] {
+		unlink(ORIGIN_FILE);
+	}, [&] {
+		repack(file, NEW_BOOT);
+		return file_size(NEW_BOOT);
+	});
+	unlink(file);
+	unlink(NEW_BOOT);
+}
+
+static const format_t codecs[] = { GZIP, XZ, LZMA, BZIP2, LZ4, LZ4_LEGACY };
+
+static void bench_codecs(const buf_stream &raw) {
+	for (format_t fmt : codecs) {
+		char name[16];
+		get_fmt_name(fmt, name);
+		buf_stream *packed = nullptr;
+		bench("compress", name, raw.size(), [&] {
+			delete packed;
+			packed = new buf_stream();
+			compress(fmt, *packed, raw.data(), raw.size());
+			return packed->size();
+		});
+		bench("decompress", name, packed->size(), [&] {
+			buf_stream os;
+			decompress(fmt, os, packed->data(), packed->size());
+			if (os.size() != raw.size())
+				LOGE("%s: decompressed %zu bytes instead of %zu\n", name, os.size(), raw.size());
+			return os.size();
+		});
+		delete packed;
+	}
+}
+
+static void bench_cpio(const buf_stream &ramdisk) {
+	bench("cpio_load", "ramdisk", ramdisk.size(), [&] {
+		delete load_ramdisk(ramdisk.data(), ramdisk.size());
+		return (size_t) 0;
+	});
+
+	cpio *rd = load_ramdisk(ramdisk.data(), ramdisk.size());
+	bench("cpio_dump", "ramdisk", ramdisk.size(), [&] {
+		buf_stream os;
+		return rd->dump(os);
+	});
+	delete rd;
+
+	// Backup compares a patched ramdisk against the original one
+	dump_file("orig.cpio", ramdisk.data(), ramdisk.size());
+	char patch_cmd[] = "patch false false";
+	char backup_cmd[] = "backup orig.cpio";
+	char *patch_argv[] = { patch_cmd };
+	char *backup_argv[] = { backup_cmd };
+	int ret;
+	bench("cpio_backup", "ramdisk", ramdisk.size(), [&] {
+		rd = load_ramdisk(ramdisk.data(), ramdisk.size());
+		strcpy(patch_cmd, "patch false false");
+		ramdisk_commands(rd, 1, patch_argv, ret);
+	}, [&] {
+		strcpy(backup_cmd, "backup orig.cpio");
+		ramdisk_commands(rd, 1, backup_argv, ret);
+		buf_stream os;
+		size_t size = rd->dump(os);
+		delete rd;
+		return size;
+	});
+	unlink("orig.cpio");
+}
+
+static void bench_hexpatch(const buf_stream &kernel) {
+	char from[] = "736B69705F696E697472616D667300";  // skip_initramfs
+	char to[] = "77616E745F696E697472616D667300";    // want_initramfs
+	char *argv[] = { from, to };
+	bench("hexpatch", "kernel", kernel.size(), [&] {
+		dump_file("hexpatch.bin", kernel.data(), kernel.size());
+	}, [&] {
+		hexpatch("hexpatch.bin", 2, argv);
+		return file_size("hexpatch.bin");
+	});
+	unlink("hexpatch.bin");
+}
+
+static void bench_dtb(const buf_stream &dtbs) {
+	bench("dtb_patch", "dtb", dtbs.size(), [&] {
+		dump_file("bench.dtb", dtbs.data(), dtbs.size());
+	}, [&] {
+		dtb_patch("bench.dtb", true);
+		return file_size("bench.dtb");
+	});
+	unlink("bench.dtb");
+}
+
+int main(int argc, char *argv[]) {
+	cmdline_logging();
+	umask(0);
+
+	const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/data/local/tmp";
+	for (int i = 1; i < argc; ++i) {
+		if (strncmp(argv[i], "--threads=", 10) == 0)
+			nr_threads = atoi(argv[i] + 10);
+		else if (strncmp(argv[i], "--runs=", 7) == 0)
+			runs = atoi(argv[i] + 7);
+		else if (strncmp(argv[i], "--entries=", 10) == 0)
+			entries = atoi(argv[i] + 10);
+		else if (strncmp(argv[i], "--kernel=", 9) == 0)
+			kernel_size = strtoul(argv[i] + 9, nullptr, 10) << 20;
+		else if (strncmp(argv[i], "--dtbs=", 7) == 0)
+			dtb_count = atoi(argv[i] + 7);
+		else if (strncmp(argv[i], "--dir=", 6) == 0)
+			dir = argv[i] + 6;
+		else if (strcmp(argv[i], "-v") == 0)
+			verbose = true;
+		else
+			usage(argv[0]);
+	}
+	if (runs < 1 || kernel_size == 0)
+		usage(argv[0]);
+
+	char work[PATH_MAX];
+	snprintf(work, sizeof(work), "%s/magiskboot_bench.XXXXXX", dir);
+	if (mkdtemp(work) == nullptr || chdir(work))
+		LOGE("Cannot create working directory in [%s]\n", dir);
+	fprintf(stderr, "Benchmark in [%s] with %d threads\n", work, get_threads());
+
+	fprintf(stderr, "Generating images\n");
+	buf_stream raw_kernel, ramdisk, dtbs;
+	gen_blob(raw_kernel, kernel_size);
+	// Something for hexpatch to find
+	for (int i = 1; i <= 4; ++i) {
+		static const char needle[] = "skip_initramfs";
+		memcpy(raw_kernel.data() + kernel_size / 5 * i, needle, sizeof(needle));
+	}
+	gen_ramdisk(ramdisk);
+	gen_dtbs(dtbs);
+
+	// Compressed kernel with the DTBs appended, and a gzip ramdisk
+	buf_stream kernel, ramdisk_gz;
+	compress(GZIP, kernel, raw_kernel.data(), raw_kernel.size());
+	kernel.write(dtbs.data(), dtbs.size());
+	compress(GZIP, ramdisk_gz, ramdisk.data(), ramdisk.size());
+
+	bench_image("aosp", IMG_AOSP, kernel, ramdisk_gz);
+	bench_image("mtk", IMG_MTK, kernel, ramdisk_gz);
+	bench_image("dhtb", IMG_DHTB, kernel, ramdisk_gz);
+	bench_codecs(raw_kernel);
+	bench_cpio(ramdisk);
+	bench_hexpatch(raw_kernel);
+	bench_dtb(dtbs);
+
+	// Leftovers of unpack
+	static const char *leftovers[] = { KERNEL_FILE, RAMDISK_FILE, DTB_FILE, ORIGIN_FILE };
+	for (const char *file : leftovers)
+		unlink(file);
+	chdir("..");
+	rmdir(work);
+	return 0;
+}
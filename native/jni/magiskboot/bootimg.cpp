@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <libfdt.h>
 #include <sys/mman.h>
 
@@ -8,7 +9,10 @@
 #include <mincrypt/sha256.h>
 
 #include "bootimg.h"
+#include "cpio.h"
 #include "magiskboot.h"
+#include "parallel.h"
+#include "profile.h"
 #include "utils.h"
 #include "logging.h"
 
@@ -20,41 +24,112 @@ static void dump(void *buf, size_t size, const char *filename) {
 	close(fd);
 }
 
-static size_t restore(const char *filename, int fd) {
-	int ifd = xopen(filename, O_RDONLY);
-	size_t size = lseek(ifd, 0, SEEK_END);
-	lseek(ifd, 0, SEEK_SET);
-	xsendfile(fd, ifd, NULL, size);
-	close(ifd);
-	return size;
-}
-
-static void restore_buf(int fd, const void *buf, size_t size) {
-	xwrite(fd, buf, size);
-}
-
 boot_img::~boot_img() {
-	munmap(map_addr, map_size);
+	if (heap)
+		free(map_addr);
+	else
+		munmap(map_addr, map_size);
 	delete hdr;
 	delete k_hdr;
 	delete r_hdr;
 	delete b_hdr;
 }
 
-#define CHROMEOS_RET       2
-#define ELF32_RET          3
-#define ELF64_RET          4
 #define pos_align() pos = align(pos, page_size())
+// Everything but the padding after the last component has to be in the image
+#define pos_take(sz) do { \
+	if (pos > left || (sz) > left - pos) \
+		return corrupt("Truncated boot image\n"); \
+	pos += (sz); \
+} while (0)
+
+static int corrupt(const char *msg) {
+	soft_error("%s", msg);
+	return CORRUPT_RET;
+}
+
+// Magic of everything parse_image acts on
+static const mem_needle hdr_magics[] = {
+	MEM_NEEDLE(CHROMEOS_MAGIC),
+	MEM_NEEDLE(BOOT_MAGIC),
+	MEM_NEEDLE(ELF32_MAGIC),
+	MEM_NEEDLE(ELF64_MAGIC),
+	MEM_NEEDLE(DHTB_MAGIC),
+	MEM_NEEDLE(TEGRABLOB_MAGIC),
+};
 
 int boot_img::parse_image(const char * image) {
 	mmap_ro(image, (void **) &map_addr, &map_size);
-
-	// Parse image
 	fprintf(stderr, "Parsing boot image: [%s]\n", image);
+	if (check_fmt(map_addr, map_size) == SPARSE && !unsparse())
+		return CORRUPT_RET;
+	int ret = parse();
+	if (ret == ELF32_RET || ret == ELF64_RET) {
+		if (soft_errors == nullptr)
+			exit(ret);
+		soft_error("ELF kernel, not a boot image\n");
+	} else if (ret == NO_MAGIC_RET) {
+		soft_error("No boot image magic found!\n");
+	}
+	return ret;
+}
+
+int boot_img::parse_image(const void *buf, size_t size) {
+	heap = true;
+	map_addr = (uint8_t *) xmalloc(size);
+	map_size = size;
+	memcpy(map_addr, buf, size);
+	if (check_fmt(map_addr, map_size) == SPARSE && !unsparse())
+		return CORRUPT_RET;
+	return parse();
+}
+
+/* Replace the map with the expanded image. A memory map is expanded into an
+ * unlinked file in the current directory, so skipped blocks stay holes */
+bool boot_img::unsparse() {
+	flags |= SPARSE_FLAG;
+	sparse_blk = reinterpret_cast<sparse_hdr *>(map_addr)->blk_sz;
+	fprintf(stderr, "SPARSE_IMG      [%u]\n", sparse_blk);
+	if (heap) {
+		buf_stream os;
+		if (decompress(SPARSE, os, map_addr, map_size) < 0)
+			return false;
+		free(map_addr);
+		map_size = os.size();
+		map_addr = os.release();
+		return true;
+	}
+	char tmp[] = "sparse.XXXXXX";
+	int fd = mkstemp(tmp);
+	if (fd < 0)
+		PLOGE("mkstemp");
+	unlink(tmp);
+	long long size = decompress(SPARSE, fd, map_addr, map_size);
+	if (size == 0)
+		soft_error("Empty sparse image\n");
+	if (size <= 0) {
+		close(fd);
+		return false;
+	}
+	munmap(map_addr, map_size);
+	map_size = size;
+	map_addr = (uint8_t *) xmmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return true;
+}
+
+int boot_img::parse() {
+	prof_scope prof(PROF_PARSE, map_size);
 	for (uint8_t *head = map_addr; head < map_addr + map_size; ++head) {
+		// Skip straight to the next place where any header could start
+		head = (uint8_t *) memfind_any(head, map_addr + map_size - head,
+				hdr_magics, sizeof(hdr_magics) / sizeof(*hdr_magics), nullptr);
+		if (head == nullptr)
+			break;
 		size_t pos = 0;
+		size_t left = map_size - (head - map_addr);
 
-		switch (check_fmt(head, map_size)) {
+		switch (check_fmt(head, left)) {
 		case CHROMEOS:
 			// The caller should know it's chromeos, as it needs additional signing
 			flags |= CHROMEOS_FLAG;
@@ -65,20 +140,26 @@ int boot_img::parse_image(const char * image) {
 			fprintf(stderr, "DHTB_HDR\n");
 			break;
 		case ELF32:
-			exit(ELF32_RET);
+			return ELF32_RET;
 		case ELF64:
-			exit(ELF64_RET);
+			return ELF64_RET;
 		case BLOB:
 			flags |= BLOB_FLAG;
 			fprintf(stderr, "TEGRA_BLOB\n");
+			if (left < sizeof(blob_hdr))
+				return corrupt("Truncated blob header\n");
 			b_hdr = new blob_hdr();
 			memcpy(b_hdr, head, sizeof(blob_hdr));
 			break;
 		case AOSP:
 			// Read the header
+			if (left < sizeof(boot_img_hdr))
+				return corrupt("Truncated boot image header\n");
 			if (((boot_img_hdr*) head)->page_size >= 0x02000000) {
 				flags |= PXA_FLAG;
 				fprintf(stderr, "PXA_BOOT_HDR\n");
+				if (left < sizeof(boot_img_hdr_pxa))
+					return corrupt("Truncated boot image header\n");
 				hdr = new boot_img_hdr_pxa();
 				memcpy(hdr, head, sizeof(boot_img_hdr_pxa));
 			} else if (memcmp(((boot_img_hdr*) head)->cmdline, NOOKHD_MAGIC, 12) == 0
@@ -96,30 +177,32 @@ int boot_img::parse_image(const char * image) {
 				hdr = new boot_img_hdr();
 				memcpy(hdr, head, sizeof(boot_img_hdr));
 			}
-			pos += page_size();
+			if (page_size() == 0)
+				return corrupt("Invalid page size\n");
+			pos_take(page_size());
 
 			flags |= id()[SHA_DIGEST_SIZE] ? SHA256_FLAG : 0;
 
 			print_hdr();
 
 			kernel = head + pos;
-			pos += hdr->kernel_size;
+			pos_take(hdr->kernel_size);
 			pos_align();
 
 			ramdisk = head + pos;
-			pos += hdr->ramdisk_size;
+			pos_take(hdr->ramdisk_size);
 			pos_align();
 
 			second = head + pos;
-			pos += hdr->second_size;
+			pos_take(hdr->second_size);
 			pos_align();
 
 			extra = head + pos;
-			pos += extra_size();
+			pos_take(extra_size());
 			pos_align();
 
 			recov_dtbo = head + pos;
-			pos += recovery_dtbo_size();
+			pos_take(recovery_dtbo_size());
 			pos_align();
 
 			if (pos < map_size) {
@@ -142,6 +225,8 @@ int boot_img::parse_image(const char * image) {
 			// Check MTK
 			if (k_fmt == MTK) {
 				fprintf(stderr, "MTK_KERNEL_HDR\n");
+				if (hdr->kernel_size < 512)
+					return corrupt("Truncated MTK header\n");
 				flags |= MTK_KERNEL;
 				k_hdr = new mtk_hdr();
 				memcpy(k_hdr, kernel, sizeof(mtk_hdr));
@@ -153,6 +238,8 @@ int boot_img::parse_image(const char * image) {
 			}
 			if (r_fmt == MTK) {
 				fprintf(stderr, "MTK_RAMDISK_HDR\n");
+				if (hdr->ramdisk_size < 512)
+					return corrupt("Truncated MTK header\n");
 				flags |= MTK_RAMDISK;
 				r_hdr = new mtk_hdr();
 				memcpy(r_hdr, ramdisk, sizeof(mtk_hdr));
@@ -174,42 +261,23 @@ int boot_img::parse_image(const char * image) {
 			break;
 		}
 	}
-	LOGE("No boot image magic found!\n");
-	exit(1);
+	return NO_MAGIC_RET;
 }
 
 void boot_img::find_dtb() {
+	prof_scope prof(PROF_FIND_DTB, hdr->kernel_size);
 	for (uint32_t i = 0; i < hdr->kernel_size; ++i) {
-		if (memcmp(kernel + i, DTB_MAGIC, 4))
-			continue;
-		// Check that fdt_header.totalsize does not overflow kernel image size
-		uint32_t dt_sz = fdt32_to_cpu(*(uint32_t *)(kernel + i + 4));
-		if (dt_sz > hdr->kernel_size - i) {
-			fprintf(stderr, "Invalid DTB detection at 0x%x: size (%u) > remaining (%u)\n",
-					i, dt_sz, hdr->kernel_size - i);
-			continue;
-		}
-
-		// Check that fdt_header.off_dt_struct does not overflow kernel image size
-		uint32_t dt_struct_offset = fdt32_to_cpu(*(uint32_t *)(kernel + i + 8));
-		if (dt_struct_offset > hdr->kernel_size - i) {
-			fprintf(stderr, "Invalid DTB detection at 0x%x: "
-							"struct offset (%u) > remaining (%u)\n",
-					i, dt_struct_offset, hdr->kernel_size - i);
-			continue;
-		}
-
-		// Check that fdt_node_header.tag of first node is FDT_BEGIN_NODE
-		uint32_t dt_begin_node = fdt32_to_cpu(*(uint32_t *)(kernel + i + dt_struct_offset));
-		if (dt_begin_node != FDT_BEGIN_NODE) {
-			fprintf(stderr, "Invalid DTB detection at 0x%x: "
-							"header tag of first node != FDT_BEGIN_NODE\n", i);
+		auto magic = (uint8_t *) memfind(kernel + i, hdr->kernel_size - i, DTB_MAGIC, 4);
+		if (magic == nullptr)
+			break;
+		i = magic - kernel;
+		if (!check_dtb(kernel + i, hdr->kernel_size - i, i))
 			continue;
-		}
 
 		dtb = kernel + i;
 		dt_size = hdr->kernel_size - i;
 		hdr->kernel_size = i;
+		prof.set_out(dt_size);
 		fprintf(stderr, "DTB             [%u]\n", dt_size);
 		break;
 	}
@@ -250,51 +318,172 @@ void boot_img::print_hdr() {
 	fprintf(stderr, "]\n");
 }
 
+static void sha1_hex(const void *buf, size_t size, char *hex) {
+	prof_scope prof(PROF_HASH, size);
+	uint8_t sha1[SHA_DIGEST_SIZE];
+	SHA_hash(buf, size, sha1);
+	for (int i = 0; i < SHA_DIGEST_SIZE; ++i)
+		sprintf(hex + i * 2, "%02x", sha1[i]);
+}
+
+struct component {
+	const char *file;
+	format_t fmt;
+	uint8_t *buf;
+	size_t size;
+	char src[SHA_DIGEST_SIZE * 2 + 1];
+	char sha[SHA_DIGEST_SIZE * 2 + 1];
+};
+
 int unpack(const char *image) {
 	boot_img boot {};
 	int ret = boot.parse_image(image);
-	int fd;
 
-	// Dump kernel
-	if (COMPRESSED(boot.k_fmt)) {
-		fd = creat(KERNEL_FILE, 0644);
-		decompress(boot.k_fmt, fd, boot.kernel, boot.hdr->kernel_size);
-		close(fd);
-	} else {
-		dump(boot.kernel, boot.hdr->kernel_size, KERNEL_FILE);
+	component parts[] = {
+		{ KERNEL_FILE, boot.k_fmt, boot.kernel, boot.hdr->kernel_size },
+		{ DTB_FILE, UNKNOWN, boot.dtb, boot.dt_size },
+		{ RAMDISK_FILE, boot.r_fmt, boot.ramdisk, boot.hdr->ramdisk_size },
+		{ SECOND_FILE, UNKNOWN, boot.second, boot.hdr->second_size },
+		{ EXTRA_FILE, UNKNOWN, boot.extra, boot.extra_size() },
+		{ RECV_DTBO_FILE, UNKNOWN, boot.recov_dtbo, boot.recovery_dtbo_size() },
+	};
+
+	// Every component goes to its own file, dump them all at once.
+	// The codecs share the threads, instead of each starting one per CPU
+	int codecs = 0;
+	for (auto &c : parts)
+		codecs += COMPRESSED(c.fmt);
+	int budget = thread_budget;
+	int share = codecs ? get_threads() / codecs : 1;
+	parallel_for(sizeof(parts) / sizeof(parts[0]), [&](size_t i) {
+		thread_budget = share > 1 ? share : 1;
+		component &c = parts[i];
+		if (COMPRESSED(c.fmt)) {
+			int fd = xopen(c.file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			decompress(c.fmt, fd, c.buf, c.size);
+			close(fd);
+
+			void *raw;
+			size_t raw_size;
+			mmap_ro(c.file, &raw, &raw_size);
+			sha1_hex(raw, raw_size, c.sha);
+			munmap(raw, raw_size);
+			sha1_hex(c.buf, c.size, c.src);
+		} else {
+			dump(c.buf, c.size, c.file);
+		}
+	});
+	thread_budget = budget;
+
+	// Record the origin of compressed components, so repack can reuse them
+	FILE *fp = xfopen(ORIGIN_FILE, "we");
+	for (auto &c : parts) {
+		if (COMPRESSED(c.fmt))
+			fprintf(fp, "%s %zu %zu %s %s\n", c.file, (size_t) (c.buf - boot.map_addr),
+					c.size, c.src, c.sha);
 	}
+	fclose(fp);
+	return ret;
+}
 
-	// Dump dtb
-	dump(boot.dtb, boot.dt_size, DTB_FILE);
-
-	// Dump ramdisk
-	if (COMPRESSED(boot.r_fmt)) {
-		fd = creat(RAMDISK_FILE, 0644);
-		decompress(boot.r_fmt, fd, boot.ramdisk, boot.hdr->ramdisk_size);
-		close(fd);
-	} else {
-		dump(boot.ramdisk, boot.hdr->ramdisk_size, RAMDISK_FILE);
+// Pick up the hashes unpack recorded for components still at the same place
+static void load_origin(repack_part *parts, int num, const uint8_t *map) {
+	FILE *fp = fopen(ORIGIN_FILE, "re");
+	if (fp == nullptr)
+		return;
+	char file[64], src[sizeof(parts->src)], sha[sizeof(parts->sha)];
+	size_t off, size;
+	while (fscanf(fp, "%63s %zu %zu %40s %40s", file, &off, &size, src, sha) == 5) {
+		for (int i = 0; i < num; ++i) {
+			repack_part &p = parts[i];
+			if (strcmp(p.file, file) == 0 && p.orig == map + off && p.orig_size == size) {
+				strcpy(p.src, src);
+				strcpy(p.sha, sha);
+			}
+		}
 	}
+	fclose(fp);
+}
 
-	// Dump second
-	dump(boot.second, boot.hdr->second_size, SECOND_FILE);
+static bool same_origin(repack_part &p, const void *raw, size_t raw_size) {
+	if (p.sha[0] == '\0')
+		return false;
+	char hex[sizeof(p.sha)];
+	sha1_hex(raw, raw_size, hex);
+	if (strcmp(hex, p.sha))
+		return false;
+	sha1_hex(p.orig, p.orig_size, hex);
+	return strcmp(hex, p.src) == 0;
+}
 
-	// Dump extra
-	dump(boot.extra, boot.extra_size(), EXTRA_FILE);
+static void load_part(repack_part &p) {
+	if (access(p.file, R_OK) != 0)
+		return;
+	p.exist = true;
+	void *raw;
+	size_t raw_size;
+	mmap_ro(p.file, &raw, &raw_size);
+	if (COMPRESSED(p.fmt) && same_origin(p, raw, raw_size)) {
+		// Unchanged since unpack, no need to compress again
+		fprintf(stderr, "Reuse original [%s]\n", p.file);
+		munmap(raw, raw_size);
+		p.reused = true;
+		p.buf = const_cast<uint8_t *>(p.orig);
+		p.size = p.orig_size;
+	} else if (COMPRESSED(p.fmt)) {
+		buf_stream os;
+		size_t size = compress(p.fmt, os, raw, raw_size);
+		munmap(raw, raw_size);
+		p.size = os.size();
+		p.tail = p.size - size;
+		p.buf = os.release();
+	} else {
+		p.mapped = true;
+		p.buf = (uint8_t *) raw;
+		p.size = raw_size;
+	}
+}
 
-	// Dump recovery_dtbo
-	dump(boot.recov_dtbo, boot.recovery_dtbo_size(), RECV_DTBO_FILE);
-	return ret;
+static void free_part(repack_part &p) {
+	if (p.reused)
+		return;
+	if (p.mapped)
+		munmap(p.buf, p.size);
+	else
+		free(p.buf);
 }
 
-#define file_align() write_zero(fd, align_off(lseek(fd, 0, SEEK_CUR) - header_off, boot.page_size()))
-void repack(const char* orig_image, const char* out_image) {
-	boot_img boot {};
+static size_t write_part(out_stream &os, repack_part &p) {
+	if (p.archive) {
+		if (!COMPRESSED(p.fmt))
+			return p.archive->dump(os);
+		// The archive is compressed as it is dumped
+		prof_scope prof(PROF_COMPRESS);
+		encoder_stream *enc = get_encoder(p.fmt, os);
+		prof.set_in(p.archive->dump(*enc));
+		size_t size = enc->finish();
+		delete enc;
+		prof.set_out(size);
+		return size;
+	}
+	if (p.raw)
+		return compress(p.fmt, os, p.raw, p.raw_size);
+	return p.size ? os.write(p.buf, p.size) - p.tail : 0;
+}
 
-	off_t header_off, kernel_off, ramdisk_off, second_off, extra_off;
+static void write_zero(out_stream &os, size_t size) {
+	static const uint8_t zeros[4096] = { 0 };
+	for (size_t len; size; size -= len) {
+		len = size > sizeof(zeros) ? sizeof(zeros) : size;
+		os.write(zeros, len);
+	}
+}
 
-	// Parse original image
-	boot.parse_image(orig_image);
+/* Build the new image in memory: all parts at page aligned offsets, with the
+ * checksum updated as each section is done */
+#define file_align() write_zero(os, align_off(os.size() - header_off, boot.page_size()))
+void build_image(boot_img &boot, repack_part *parts, buf_stream &os, bool print) {
+	size_t header_off, kernel_off, ramdisk_off, second_off, extra_off;
 
 	// Reset sizes
 	boot.hdr->kernel_size = 0;
@@ -302,157 +491,389 @@ void repack(const char* orig_image, const char* out_image) {
 	boot.hdr->second_size = 0;
 	boot.dt_size = 0;
 
-	fprintf(stderr, "Repack to boot image: [%s]\n", out_image);
+	size_t estimate = boot.page_size() * (NUM_PARTS + 2);
+	for (int i = 0; i < NUM_PARTS; ++i)
+		estimate += parts[i].raw ? parts[i].raw_size : parts[i].size;
+	os.reserve(estimate);
 
-	// Create new image
-	int fd = creat(out_image, 0644);
+	HASH_CTX ctx;
+	(boot.flags & SHA256_FLAG) ? SHA256_init(&ctx) : SHA_init(&ctx);
+	auto hash_section = [&](size_t off, uint32_t size) {
+		prof_scope prof(PROF_HASH, size);
+		HASH_update(&ctx, os.data() + off, size);
+		HASH_update(&ctx, &size, sizeof(size));
+	};
 
 	if (boot.flags & DHTB_FLAG) {
 		// Skip DHTB header
-		write_zero(fd, 512);
+		write_zero(os, 512);
 	} else if (boot.flags & BLOB_FLAG) {
 		// Skip blob header
-		write_zero(fd, sizeof(blob_hdr));
+		write_zero(os, sizeof(blob_hdr));
 	} else if (boot.flags & NOOKHD_FLAG) {
-		restore_buf(fd, boot.map_addr, NOOKHD_PRE_HEADER_SZ);
+		os.write(boot.map_addr, NOOKHD_PRE_HEADER_SZ);
 	} else if (boot.flags & ACCLAIM_FLAG) {
-		restore_buf(fd, boot.map_addr, ACCLAIM_PRE_HEADER_SZ);
+		os.write(boot.map_addr, ACCLAIM_PRE_HEADER_SZ);
 	}
 
 	// Skip a page for header
-	header_off = lseek(fd, 0, SEEK_CUR);
-	write_zero(fd, boot.page_size());
+	header_off = os.size();
+	write_zero(os, boot.page_size());
 
-	// kernel
-	kernel_off = lseek(fd, 0, SEEK_CUR);
+	// kernel + dtb
+	kernel_off = os.size();
 	if (boot.flags & MTK_KERNEL) {
 		// Skip MTK header
-		write_zero(fd, 512);
+		write_zero(os, 512);
 	}
-	if (access(KERNEL_FILE, R_OK) == 0) {
-		if (COMPRESSED(boot.k_fmt)) {
-			size_t raw_size;
-			void *kernel_raw;
-			mmap_ro(KERNEL_FILE, &kernel_raw, &raw_size);
-			boot.hdr->kernel_size = compress(boot.k_fmt, fd, kernel_raw, raw_size);
-			munmap(kernel_raw, raw_size);
-		} else {
-			boot.hdr->kernel_size = restore(KERNEL_FILE, fd);
-		}
+	boot.hdr->kernel_size = write_part(os, parts[KERNEL]);
+	boot.hdr->kernel_size += write_part(os, parts[DTB_PART]);
+	if (boot.flags & MTK_KERNEL) {
+		boot.k_hdr->size = boot.hdr->kernel_size;
+		boot.hdr->kernel_size += 512;
+		memcpy(os.data() + kernel_off, boot.k_hdr, sizeof(mtk_hdr));
 	}
-
-	// dtb
-	if (access(DTB_FILE, R_OK) == 0)
-		boot.hdr->kernel_size += restore(DTB_FILE, fd);
+	hash_section(kernel_off, boot.hdr->kernel_size);
 	file_align();
 
 	// ramdisk
-	ramdisk_off = lseek(fd, 0, SEEK_CUR);
+	ramdisk_off = os.size();
 	if (boot.flags & MTK_RAMDISK) {
 		// Skip MTK header
-		write_zero(fd, 512);
-	}
-	if (access(RAMDISK_FILE, R_OK) == 0) {
-		if (COMPRESSED(boot.r_fmt)) {
-			size_t cpio_size;
-			void *cpio;
-			mmap_ro(RAMDISK_FILE, &cpio, &cpio_size);
-			boot.hdr->ramdisk_size = compress(boot.r_fmt, fd, cpio, cpio_size);
-			munmap(cpio, cpio_size);
-		} else {
-			boot.hdr->ramdisk_size = restore(RAMDISK_FILE, fd);
-		}
+		write_zero(os, 512);
+	}
+	if (parts[RAMDISK].exist) {
+		boot.hdr->ramdisk_size = write_part(os, parts[RAMDISK]);
 		file_align();
 	}
+	if (boot.flags & MTK_RAMDISK) {
+		boot.r_hdr->size = boot.hdr->ramdisk_size;
+		boot.hdr->ramdisk_size += 512;
+		memcpy(os.data() + ramdisk_off, boot.r_hdr, sizeof(mtk_hdr));
+	}
+	hash_section(ramdisk_off, boot.hdr->ramdisk_size);
 
 	// second
-	second_off = lseek(fd, 0, SEEK_CUR);
-	if (access(SECOND_FILE, R_OK) == 0) {
-		boot.hdr->second_size = restore(SECOND_FILE, fd);
+	second_off = os.size();
+	if (parts[SECOND].exist) {
+		boot.hdr->second_size = write_part(os, parts[SECOND]);
 		file_align();
 	}
+	hash_section(second_off, boot.hdr->second_size);
 
 	// extra
-	extra_off = lseek(fd, 0, SEEK_CUR);
-	if (access(EXTRA_FILE, R_OK) == 0) {
-		boot.extra_size(restore(EXTRA_FILE, fd));
+	extra_off = os.size();
+	if (parts[EXTRA].exist) {
+		boot.extra_size(write_part(os, parts[EXTRA]));
 		file_align();
 	}
+	if (boot.extra_size())
+		hash_section(extra_off, boot.extra_size());
 
 	// recovery_dtbo
-	if (access(RECV_DTBO_FILE, R_OK) == 0) {
-		boot.recovery_dtbo_offset(lseek(fd, 0, SEEK_CUR));
-		boot.recovery_dtbo_size(restore(RECV_DTBO_FILE, fd));
+	if (parts[RECV_DTBO].exist) {
+		boot.recovery_dtbo_offset(os.size());
+		boot.recovery_dtbo_size(write_part(os, parts[RECV_DTBO]));
 		file_align();
 	}
+	if (boot.header_version())
+		hash_section(parts[RECV_DTBO].exist ? boot.recovery_dtbo_offset() : 0,
+				boot.recovery_dtbo_size());
 
 	// Append tail info
 	if (boot.flags & SEANDROID_FLAG) {
-		restore_buf(fd, SEANDROID_MAGIC "\xFF\xFF\xFF\xFF", 20);
+		os.write(SEANDROID_MAGIC "\xFF\xFF\xFF\xFF", 20);
 	}
 	if (boot.flags & LG_BUMP_FLAG) {
-		restore_buf(fd, LG_BUMP_MAGIC, 16);
-	}
-
-	close(fd);
-
-	// Map output image as rw
-	munmap(boot.map_addr, boot.map_size);
-	mmap_rw(out_image, (void **) &boot.map_addr, &boot.map_size);
-
-	// MTK headers
-	if (boot.flags & MTK_KERNEL) {
-		boot.k_hdr->size = boot.hdr->kernel_size;
-		boot.hdr->kernel_size += 512;
-		memcpy(boot.map_addr + kernel_off, boot.k_hdr, sizeof(mtk_hdr));
-	}
-	if (boot.flags & MTK_RAMDISK) {
-		boot.r_hdr->size = boot.hdr->ramdisk_size;
-		boot.hdr->ramdisk_size += 512;
-		memcpy(boot.map_addr + ramdisk_off, boot.r_hdr, sizeof(mtk_hdr));
+		os.write(LG_BUMP_MAGIC, 16);
 	}
 
 	// Update checksum
-	HASH_CTX ctx;
-	(boot.flags & SHA256_FLAG) ? SHA256_init(&ctx) : SHA_init(&ctx);
-	uint32_t size = boot.hdr->kernel_size;
-	HASH_update(&ctx, boot.map_addr + kernel_off, size);
-	HASH_update(&ctx, &size, sizeof(size));
-	size = boot.hdr->ramdisk_size;
-	HASH_update(&ctx, boot.map_addr + ramdisk_off, size);
-	HASH_update(&ctx, &size, sizeof(size));
-	size = boot.hdr->second_size;
-	HASH_update(&ctx, boot.map_addr + second_off, size);
-	HASH_update(&ctx, &size, sizeof(size));
-	size = boot.extra_size();
-	if (size) {
-		HASH_update(&ctx, boot.map_addr + extra_off, size);
-		HASH_update(&ctx, &size, sizeof(size));
-	}
-	if (boot.header_version()) {
-		size = boot.recovery_dtbo_size();
-		HASH_update(&ctx, boot.map_addr + boot.recovery_dtbo_offset(), size);
-		HASH_update(&ctx, &size, sizeof(size));
-	}
 	memset(boot.id(), 0, 32);
 	memcpy(boot.id(), HASH_final(&ctx),
 		   (boot.flags & SHA256_FLAG) ? SHA256_DIGEST_SIZE : SHA_DIGEST_SIZE);
 
 	// Print new image info
-	boot.print_hdr();
+	if (print)
+		boot.print_hdr();
 
 	// Main header
-	memcpy(boot.map_addr + header_off, boot.hdr, boot.hdr_size());
+	memcpy(os.data() + header_off, boot.hdr, boot.hdr_size());
 
 	if (boot.flags & DHTB_FLAG) {
 		// DHTB header
-		dhtb_hdr *hdr = reinterpret_cast<dhtb_hdr *>(boot.map_addr);
+		dhtb_hdr *hdr = reinterpret_cast<dhtb_hdr *>(os.data());
 		memcpy(hdr, DHTB_MAGIC, 8);
-		hdr->size = boot.map_size - 512;
-		SHA256_hash(boot.map_addr + 512, hdr->size, hdr->checksum);
+		hdr->size = os.size() - 512;
+		prof_scope prof(PROF_HASH, hdr->size);
+		SHA256_hash(os.data() + 512, hdr->size, hdr->checksum);
 	} else if (boot.flags & BLOB_FLAG) {
 		// Blob headers
-		boot.b_hdr->size = boot.map_size - sizeof(blob_hdr);
-		memcpy(boot.map_addr, boot.b_hdr, sizeof(blob_hdr));
+		boot.b_hdr->size = os.size() - sizeof(blob_hdr);
+		memcpy(os.data(), boot.b_hdr, sizeof(blob_hdr));
+	}
+}
+
+struct fit_trial {
+	int part;
+	const comp_setting *setting;
+	uint8_t *buf;
+	size_t size;
+	size_t tail;
+	double decode_ms;
+};
+
+static double now_ms() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Compress all compressed parts again with stronger settings, until the image
+ * in os is at most max_size. All settings of all parts are tried at once, then
+ * the combination that fits and decodes fastest wins. The first trial of a
+ * part is what it has now, which may be the original from the image */
+static void fit_image(boot_img &boot, repack_part *parts, buf_stream &os, size_t max_size) {
+	fprintf(stderr, "Image size [%zu] is over the limit [%zu]\n", os.size(), max_size);
+
+	// Settings of the k-th part being tuned are trials[first[k], first[k] + count[k])
+	int first[NUM_PARTS], count[NUM_PARTS], num = 0;
+	void *raw[NUM_PARTS];
+	size_t raw_size[NUM_PARTS];
+	Array<fit_trial> trials;
+	for (int i = 0; i < NUM_PARTS; ++i) {
+		repack_part &p = parts[i];
+		const comp_setting *list;
+		if (!p.exist || !COMPRESSED(p.fmt))
+			continue;
+		mmap_ro(p.file, &raw[i], &raw_size[i]);
+		first[num] = trials.size();
+		count[num] = comp_settings(p.fmt, list);
+		for (int j = 0; j < count[num]; ++j) {
+			fit_trial t { i, &list[j] };
+			if (j == 0) {
+				// Done already
+				t.buf = p.buf;
+				t.size = p.size;
+				t.tail = p.tail;
+			}
+			trials.push_back(t);
+		}
+		++num;
+	}
+	if (num == 0)
+		LOGE("No part left to compress any further\n");
+
+	int budget = thread_budget;
+	int share = get_threads() / (int) trials.size();
+	parallel_for(trials.size(), [&](size_t k) {
+		fit_trial &t = trials[k];
+		if (t.buf)
+			return;
+		thread_budget = share > 1 ? share : 1;
+		buf_stream out;
+		size_t size = compress(parts[t.part].fmt, out, raw[t.part], raw_size[t.part], t.setting->opts);
+		t.size = out.size();
+		t.tail = t.size - size;
+		t.buf = out.release();
+	});
+
+	// Bootloaders and kernels decode on a single thread
+	thread_budget = 1;
+	for (auto &t : trials) {
+		buf_stream out;
+		out.reserve(raw_size[t.part]);
+		double start = now_ms();
+		decompress(parts[t.part].fmt, out, t.buf, t.size);
+		t.decode_ms = now_ms() - start;
+		if (out.size() != raw_size[t.part] || memcmp(out.data(), raw[t.part], out.size()))
+			LOGE("[%s] with %s does not decode to its input\n", parts[t.part].file, t.setting->name);
+	}
+	thread_budget = budget;
+
+	// Go through combinations by decode time, only building those that could fit
+	int combos = 1;
+	for (int k = 0; k < num; ++k)
+		combos *= count[k];
+	Array<bool> tried;
+	for (int c = 0; c < combos; ++c)
+		tried.push_back(false);
+	size_t base = os.size(), smallest = base;
+	int pick[NUM_PARTS];
+	bool fit = false;
+	for (int n = 0; n < combos && !fit; ++n) {
+		int best = -1;
+		double best_ms = 0;
+		for (int c = 0; c < combos; ++c) {
+			double ms = 0;
+			size_t size = base;
+			bool useless = false;
+			for (int k = 0, rest = c; k < num; rest /= count[k], ++k) {
+				fit_trial &t = trials[first[k] + rest % count[k]];
+				ms += t.decode_ms;
+				size = size + t.size - trials[first[k]].size;
+				// Keep parts as they are unless it makes them smaller
+				useless |= rest % count[k] && t.size >= trials[first[k]].size;
+			}
+			if (size < smallest)
+				smallest = size;
+			// Page alignment of each part may make the image a bit larger or smaller
+			if (tried[c] || useless || size > max_size + num * boot.page_size())
+				continue;
+			if (best < 0 || ms < best_ms) {
+				best = c;
+				best_ms = ms;
+			}
+		}
+		if (best < 0)
+			break;
+		tried[best] = true;
+		for (int k = 0, rest = best; k < num; rest /= count[k], ++k) {
+			pick[k] = first[k] + rest % count[k];
+			fit_trial &t = trials[pick[k]];
+			repack_part &p = parts[t.part];
+			p.buf = t.buf;
+			p.size = t.size;
+			p.tail = t.tail;
+			p.reused = t.buf == p.orig;
+		}
+		free(os.release());
+		build_image(boot, parts, os, false);
+		fit = os.size() <= max_size;
+	}
+	if (!fit)
+		LOGE("Image cannot fit in [%zu], the smallest is about [%zu]\n", max_size, smallest);
+
+	for (int k = 0; k < num; ++k) {
+		fit_trial &t = trials[pick[k]];
+		repack_part &p = parts[t.part];
+		fprintf(stderr, "Compress [%s] with %s: [%zu] decoded in [%.1fms]\n", p.file,
+				p.reused ? "the original settings" : t.setting->name, t.size, t.decode_ms);
+		munmap(raw[t.part], raw_size[t.part]);
+	}
+	for (size_t i = 0; i < trials.size(); ++i) {
+		bool keep = trials[i].buf == parts[trials[i].part].orig;
+		for (int k = 0; k < num; ++k)
+			keep |= pick[k] == (int) i;
+		if (!keep)
+			free(trials[i].buf);
 	}
 }
+
+// Then write it out in one go, returns false if out_image cannot be created
+static bool write_image(boot_img &boot, repack_part *parts, const char *out_image,
+		size_t max_size = 0) {
+	fprintf(stderr, "Repack to boot image: [%s]\n", out_image);
+	buf_stream os;
+	build_image(boot, parts, os, max_size == 0);
+	if (max_size) {
+		if (os.size() > max_size)
+			fit_image(boot, parts, os, max_size);
+		boot.print_hdr();
+	}
+	int fd = creat(out_image, 0644);
+	if (fd < 0) {
+		soft_error("Cannot create [%s]\n", out_image);
+		return false;
+	}
+	if (boot.flags & SPARSE_FLAG) {
+		// Back into the container of the original image
+		fd_stream out(fd);
+		sparse(1, out, os.data(), os.size(), boot.sparse_blk);
+	} else {
+		xwrite(fd, os.data(), os.size());
+	}
+	close(fd);
+	return true;
+}
+
+void repack(const char* orig_image, const char* out_image, size_t max_size) {
+	boot_img boot {};
+
+	// Parse original image
+	boot.parse_image(orig_image);
+
+	repack_part parts[NUM_PARTS] = {
+		{ KERNEL_FILE, boot.k_fmt, boot.kernel, boot.hdr->kernel_size },
+		{ DTB_FILE, UNKNOWN },
+		{ RAMDISK_FILE, boot.r_fmt, boot.ramdisk, boot.hdr->ramdisk_size },
+		{ SECOND_FILE, UNKNOWN },
+		{ EXTRA_FILE, UNKNOWN },
+		{ RECV_DTBO_FILE, UNKNOWN },
+	};
+	load_origin(parts, NUM_PARTS, boot.map_addr);
+
+	// Compress and load all components concurrently, the codecs sharing the threads
+	int codecs = 0;
+	for (auto &p : parts)
+		codecs += COMPRESSED(p.fmt);
+	int budget = thread_budget;
+	int share = codecs ? get_threads() / codecs : 1;
+	parallel_for(NUM_PARTS, [&](size_t i) {
+		thread_budget = share > 1 ? share : 1;
+		load_part(parts[i]);
+	});
+	thread_budget = budget;
+
+	write_image(boot, parts, out_image, max_size);
+
+	for (auto &p : parts)
+		free_part(p);
+}
+
+void orig_part(repack_part &p, uint8_t *buf, size_t size) {
+	p.exist = size > 0;
+	p.reused = true;
+	p.buf = buf;
+	p.size = size;
+}
+
+int patch(const char *in_image, const char *out_image, int argc, char *argv[]) {
+	boot_img boot {};
+	int ret = boot.parse_image(in_image);
+	if (ret != 0 && ret != CHROMEOS_RET)
+		return 1;
+
+	// Everything except the ramdisk is copied as is
+	repack_part parts[NUM_PARTS] = {};
+	orig_part(parts[KERNEL], boot.kernel, boot.hdr->kernel_size);
+	orig_part(parts[DTB_PART], boot.dtb, boot.dt_size);
+	orig_part(parts[SECOND], boot.second, boot.hdr->second_size);
+	orig_part(parts[EXTRA], boot.extra, boot.extra_size());
+	orig_part(parts[RECV_DTBO], boot.recov_dtbo, boot.recovery_dtbo_size());
+
+	// Run cpio commands on the ramdisk in memory
+	buf_stream raw;
+	const void *ramdisk = boot.ramdisk;
+	size_t ramdisk_size = boot.hdr->ramdisk_size;
+	if (COMPRESSED(boot.r_fmt)) {
+		if (decompress(boot.r_fmt, raw, ramdisk, ramdisk_size) < 0)
+			return 1;
+		ramdisk = raw.data();
+		ramdisk_size = raw.size();
+	}
+	cpio *rd = ramdisk_commands(ramdisk, ramdisk_size, argc, argv, ret);
+	if (rd == nullptr)
+		return ret;
+
+	repack_part &p = parts[RAMDISK];
+	p.exist = true;
+	p.fmt = boot.r_fmt;
+	buf_stream dumped;
+	if (COMPRESSED(p.fmt) && get_threads() == 1) {
+		// The parallel encoders need all input at once, otherwise dump straight into the encoder
+		p.archive = rd;
+	} else {
+		rd->dump(dumped);
+		if (COMPRESSED(p.fmt)) {
+			p.raw = dumped.data();
+			p.raw_size = dumped.size();
+		} else {
+			orig_part(p, dumped.data(), dumped.size());
+		}
+	}
+
+	ret = write_image(boot, parts, out_image) ? 0 : 1;
+	delete rd;
+	return ret;
+}
@@ -1,5 +1,8 @@
 #include <stdint.h>
+#include <mincrypt/sha.h>
+
 #include "format.h"
+#include "stream.h"
 
 #ifndef _BOOT_IMAGE_H_
 #define _BOOT_IMAGE_H_
@@ -131,6 +134,32 @@ struct blob_hdr {
 	uint32_t version;       /* 0x00000001 */
 } __attribute__((packed));
 
+/* Android sparse image, a file header followed by total_chunks chunks. Every
+ * chunk has a chunk header, then its data, both possibly longer than these */
+#define CHUNK_TYPE_RAW        0xCAC1  /* Data of chunk_sz blocks */
+#define CHUNK_TYPE_FILL       0xCAC2  /* A 4 byte pattern repeated over chunk_sz blocks */
+#define CHUNK_TYPE_DONT_CARE  0xCAC3  /* Nothing, chunk_sz blocks are skipped */
+#define CHUNK_TYPE_CRC32      0xCAC4  /* CRC32 of everything up to here */
+
+struct sparse_hdr {
+	uint32_t magic;          /* 0xed26ff3a */
+	uint16_t major_version;  /* 1 */
+	uint16_t minor_version;  /* 0 */
+	uint16_t file_hdr_sz;    /* 28 */
+	uint16_t chunk_hdr_sz;   /* 12 */
+	uint32_t blk_sz;         /* Block size in bytes, a multiple of 4 */
+	uint32_t total_blks;     /* Blocks in the expanded image */
+	uint32_t total_chunks;   /* Chunks in the sparse image */
+	uint32_t image_checksum; /* CRC32 of the expanded image, usually 0 */
+} __attribute__((packed));
+
+struct sparse_chunk_hdr {
+	uint16_t chunk_type;     /* CHUNK_TYPE_* */
+	uint16_t reserved;
+	uint32_t chunk_sz;       /* Blocks in the expanded image */
+	uint32_t total_sz;       /* Bytes of the chunk, including this header */
+} __attribute__((packed));
+
 // Flags
 #define MTK_KERNEL      0x0001
 #define MTK_RAMDISK     0x0002
@@ -143,11 +172,22 @@ struct blob_hdr {
 #define BLOB_FLAG       0x0100
 #define NOOKHD_FLAG     0x0200
 #define ACCLAIM_FLAG    0x0400
+#define SPARSE_FLAG     0x0800
+
+// Return values of parse_image
+#define NO_MAGIC_RET       1
+#define CHROMEOS_RET       2
+#define ELF32_RET          3
+#define ELF64_RET          4
+// Only returned if errors are soft, otherwise it exits
+#define CORRUPT_RET        5
 
 struct boot_img {
 	// Memory map of the whole image
 	uint8_t *map_addr;
 	size_t map_size;
+	// map_addr is a heap copy instead of a memory map
+	bool heap;
 
 	// Headers
 	boot_img_hdr_base *hdr;  /* Android boot image header */
@@ -157,6 +197,8 @@ struct boot_img {
 
 	// Flags to indicate the state of current boot image
 	uint16_t flags;
+	// Block size of the sparse image it was expanded from
+	uint32_t sparse_blk;
 
 	// The format of kernel and ramdisk
 	format_t k_fmt;
@@ -179,7 +221,12 @@ struct boot_img {
 
 	~boot_img();
 
+	// Exits if image is not something that can be repacked, unless errors are soft
 	int parse_image(const char *);
+	// Parses a copy of buf, the return value tells whether it can be repacked
+	int parse_image(const void *buf, size_t size);
+	int parse();
+	bool unsparse();
 	void find_dtb();
 	void print_hdr();
 
@@ -227,4 +274,33 @@ static_cast<boot_img_hdr_v1 *>(hdr)->x)
 	}
 };
 
+class cpio;
+
+/* Output of a repack task: the mapped file, a compressed heap buffer,
+ * or the untouched compressed bytes of the original image. If raw or archive
+ * is set instead, it is compressed straight into the image when written */
+struct repack_part {
+	const char *file;
+	format_t fmt;
+	const uint8_t *orig;
+	size_t orig_size;
+	bool exist;
+	bool mapped;
+	bool reused;
+	uint8_t *buf;
+	size_t size;
+	size_t tail;  // Bytes after the data not counted in its size (lz4_legacy trailer)
+	const void *raw;
+	size_t raw_size;
+	cpio *archive;
+	char src[SHA_DIGEST_SIZE * 2 + 1];
+	char sha[SHA_DIGEST_SIZE * 2 + 1];
+};
+
+enum { KERNEL, DTB_PART, RAMDISK, SECOND, EXTRA, RECV_DTBO, NUM_PARTS };
+
+// Use size bytes at buf as they are
+void orig_part(repack_part &p, uint8_t *buf, size_t size);
+void build_image(boot_img &boot, repack_part *parts, buf_stream &os, bool print = true);
+
 #endif
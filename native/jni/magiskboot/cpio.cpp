@@ -2,56 +2,71 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "cpio.h"
+#include "parallel.h"
+#include "profile.h"
 #include "utils.h"
 #include "logging.h"
 
-#define parse_align() lseek(fd, align(lseek(fd, 0, SEEK_CUR), 4), SEEK_SET)
-
-static uint32_t x8u(char *hex) {
-	uint32_t val, inpos = 8, outpos;
-	char pattern[6];
-
-	while (*hex == '0') {
-		hex++;
-		if (!--inpos) return 0;
+/* '0'-'9' have bit 6 clear, 'a'-'f' and 'A'-'F' have it set. Anything else
+ * is caught in the same pass and sets bad */
+static uint32_t x8u(const char *hex, bool &bad) {
+	uint32_t val = 0;
+	bool ok = true;
+	for (int i = 0; i < 8; ++i) {
+		uint32_t c = (uint8_t) hex[i];
+		ok &= c - '0' < 10 || (c | 0x20) - 'a' < 6;
+		val = (val << 4) | ((c & 0xf) + 9 * (c >> 6));
 	}
-	// Because scanf gratuitously treats %*X differently than printf does.
-	sprintf(pattern, "%%%dx%%n", inpos);
-	sscanf(hex, pattern, &val, &outpos);
-	if (inpos != outpos)
-		LOGE("bad cpio header\n");
-
+	bad |= !ok;
 	return val;
 }
 
-cpio_entry::cpio_entry(int fd, cpio_newc_header &header) {
+void cpio_map::release() {
+	if (--ref)
+		return;
+	if (mapped)
+		munmap(buf, size);
+	delete this;
+}
+
+cpio_entry::cpio_entry(const cpio_newc_header &header, bool &bad) {
 	// ino = x8u(header.ino);
-	mode = x8u(header.mode);
-	uid = x8u(header.uid);
-	gid = x8u(header.gid);
+	mode = x8u(header.mode, bad);
+	uid = x8u(header.uid, bad);
+	gid = x8u(header.gid, bad);
 	// nlink = x8u(header.nlink);
 	// mtime = x8u(header.mtime);
-	filesize = x8u(header.filesize);
+	filesize = x8u(header.filesize, bad);
 	// devmajor = x8u(header.devmajor);
 	// devminor = x8u(header.devminor);
 	// rdevmajor = x8u(header.rdevmajor);
 	// rdevminor = x8u(header.rdevminor);
-	uint32_t namesize = x8u(header.namesize);
+	// namesize = x8u(header.namesize);
 	// check = x8u(header.check);
-	filename = CharArray(namesize);
-	xxread(fd, filename, filename.size());
-	parse_align();
-	if (filesize) {
-		data = xmalloc(filesize);
-		xxread(fd, data, filesize);
-		parse_align();
-	}
 }
 
 cpio_entry::~cpio_entry() {
-	free(data);
+	if (map)
+		map->release();
+	else
+		free(data);
+}
+
+void cpio_entry::detach() {
+	if (map == nullptr)
+		return;
+	void *copy = xmalloc(filesize);
+	memcpy(copy, data, filesize);
+	data = copy;
+	map->release();
+	map = nullptr;
 }
 
 // Define the way to sort cpio_entry
@@ -63,110 +78,408 @@ int(*Array<cpio_entry*>::_cmp)(cpio_entry*&, cpio_entry*&) = [](auto a, auto b)
 	return a->filename.compare(b->filename);
 };
 
+// Entry new to the archive, with its index in the list it is inserted from
+struct new_entry {
+	cpio_entry *e;
+	size_t i;
+};
+
+// qsort is not stable, entries with the same name stay in list order
+template<>
+int(*Array<new_entry>::_cmp)(new_entry&, new_entry&) = [](auto a, auto b) -> int {
+	if (int c = a.e->filename.compare(b.e->filename))
+		return c;
+	return a.i < b.i ? -1 : a.i > b.i;
+};
+
 
-cpio::cpio(const char *filename) {
-	int fd = open(filename, O_RDONLY);
-	if (fd < 0) return;
+bool cpio::load(const char *filename) {
+	if (access(filename, R_OK) != 0)
+		return true;
 	fprintf(stderr, "Loading cpio: [%s]\n", filename);
-	cpio_newc_header header;
-	cpio_entry *entry;
-	while(xxread(fd, &header, sizeof(cpio_newc_header)) != -1) {
-		entry = new cpio_entry(fd, header);
+	auto map = new cpio_map { nullptr, 0, true, 1 };
+	mmap_ro(filename, &map->buf, &map->size);
+	return parse(map);
+}
+
+bool cpio::load(const void *buf, size_t size) {
+	return parse(new cpio_map { const_cast<void *>(buf), size, false, 1 });
+}
+
+/* Entries keep pointing into the archive for their data, so loading
+ * only has to decode the headers and copy the file names. On errors
+ * the entries loaded so far are kept */
+#define parse_align() pos = align(pos, 4)
+bool cpio::parse(cpio_map *map) {
+	prof_scope prof(PROF_CPIO_LOAD, map->size);
+	const uint8_t *buf = (uint8_t *) map->buf;
+	size_t size = map->size;
+	size_t pos = 0;
+	bool ok = true;
+	while (pos + sizeof(cpio_newc_header) <= size) {
+		auto &header = *(const cpio_newc_header *) (buf + pos);
+		if (memcmp(header.magic, "070701", 6)) {
+			soft_error("bad cpio header\n");
+			ok = false;
+			break;
+		}
+		pos += sizeof(cpio_newc_header);
+		bool bad = false;
+		uint32_t namesize = x8u(header.namesize, bad);
+		auto entry = new cpio_entry(header, bad);
+		if (bad) {
+			soft_error("bad cpio header\n");
+			delete entry;
+			ok = false;
+			break;
+		}
+		if (namesize > size - pos) {
+			soft_error("bad cpio entry\n");
+			delete entry;
+			ok = false;
+			break;
+		}
+		entry->filename = CharArray(namesize);
+		memcpy(entry->filename, buf + pos, namesize);
+		pos += namesize;
+		parse_align();
+		if (entry->filesize) {
+			if (pos > size || entry->filesize > size - pos) {
+				soft_error("bad cpio entry\n");
+				delete entry;
+				ok = false;
+				break;
+			}
+			entry->data = (void *) (buf + pos);
+			entry->map = map;
+			++map->ref;
+			pos += entry->filesize;
+			parse_align();
+		}
 		if (entry->filename == "." || entry->filename == ".." || entry->filename == "TRAILER!!!") {
 			bool trailer = entry->filename[0] == 'T';
 			delete entry;
 			if (trailer)
 				break;
+			continue;
+		}
+		if (cpio_entry *old = find(entry->filename)) {
+			// Later entries of the same name win
+			index_del(old);
+			old->mode = entry->mode;
+			old->uid = entry->uid;
+			old->gid = entry->gid;
+			old->filesize = entry->filesize;
+			void *data = old->data;
+			cpio_map *m = old->map;
+			old->data = entry->data;
+			old->map = entry->map;
+			entry->data = data;
+			entry->map = m;
+			delete entry;
+			index_add(old);
+			continue;
 		}
 		arr.push_back(entry);
+		index_add(entry);
 	}
-	close(fd);
+	map->release();
+	arr.sort();
+	return ok;
 }
 
 cpio::~cpio() {
 	for (auto &e : arr)
 		if (e) delete e;
+	delete[] table;
+}
+
+// FNV-1a
+cpio_entry **cpio::bucket(const char *name) {
+	uint32_t h = 2166136261U;
+	for (; *name; ++name)
+		h = (h ^ (uint8_t) *name) * 16777619U;
+	return &table[h & (table_size - 1)];
+}
+
+void cpio::rehash() {
+	cpio_entry **old = table;
+	size_t old_size = table_size;
+	table_size = table_size ? table_size * 2 : 256;
+	table = new cpio_entry*[table_size]();
+	for (size_t i = 0; i < old_size; ++i) {
+		for (cpio_entry *e = old[i], *next; e; e = next) {
+			next = e->next;
+			cpio_entry **b = bucket(e->filename);
+			e->next = *b;
+			*b = e;
+		}
+	}
+	delete[] old;
+}
+
+void cpio::index_add(cpio_entry *e) {
+	// Keep the load factor below 1, counting the entry being added
+	if (arr.size() >= table_size)
+		rehash();
+	cpio_entry **b = bucket(e->filename);
+	e->next = *b;
+	*b = e;
+}
+
+void cpio::index_del(cpio_entry *e) {
+	for (cpio_entry **p = bucket(e->filename); *p; p = &(*p)->next) {
+		if (*p == e) {
+			*p = e->next;
+			break;
+		}
+	}
+	e->next = nullptr;
+}
+
+cpio_entry *cpio::find(const char *name) {
+	if (table_size == 0)
+		return nullptr;
+	for (cpio_entry *e = *bucket(name); e; e = e->next)
+		if (e->filename == name)
+			return e;
+	return nullptr;
+}
+
+size_t cpio::lower_bound(const char *name) {
+	size_t lo = 0, hi = arr.size();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (arr[mid]->filename.compare(name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void cpio::subtree(const char *dir, size_t &begin, size_t &end) {
+	// Names starting with "dir/" sort between "dir/" and "dir0"
+	size_t len = strlen(dir);
+	char *key = new char[len + 2];
+	memcpy(key, dir, len);
+	key[len] = '/';
+	key[len + 1] = '\0';
+	begin = lower_bound(key);
+	key[len] = '/' + 1;
+	end = lower_bound(key);
+	delete[] key;
+}
+
+void cpio::erase(size_t begin, size_t end) {
+	if (begin >= end)
+		return;
+	for (size_t i = begin; i < end; ++i) {
+		index_del(arr[i]);
+		delete arr[i];
+	}
+	size_t n = arr.size();
+	for (size_t i = end; i < n; ++i)
+		arr[i - (end - begin)] = arr[i];
+	for (size_t i = begin; i < end; ++i)
+		arr.pop_back();
 }
 
-#define dump_align() write_zero(fd, align_off(lseek(fd, 0, SEEK_CUR), 4))
 void cpio::dump(const char *file) {
 	fprintf(stderr, "Dump cpio: [%s]\n", file);
-	unsigned inode = 300000;
-	char header[111];
-	sort();
+	// Entries may still be backed by a mapping of file, never truncate it
+	unlink(file);
 	int fd = creat(file, 0644);
-	for (auto &e : arr) {
-		sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
-				inode++,    // e->ino
-				e->mode,
-				e->uid,
-				e->gid,
-				1,          // e->nlink
-				0,          // e->mtime
-				e->filesize,
-				0,          // e->devmajor
-				0,          // e->devminor
-				0,          // e->rdevmajor
-				0,          // e->rdevminor
-				(uint32_t) e->filename.size(),
-				0           // e->check
-		);
-		xwrite(fd, header, 110);
-		xwrite(fd, e->filename, e->filename.size());
-		dump_align();
-		if (e->filesize) {
-			xwrite(fd, e->data, e->filesize);
-			dump_align();
+	fd_stream os(fd);
+	dump(os);
+	close(fd);
+}
+
+#define DUMP_IOV     256
+#define DUMP_BUF     0x10000
+#define DUMP_INLINE  512
+
+/* Small pieces (headers, names, padding, small files) are copied into a
+ * staging buffer, larger payloads are referenced in place. Everything
+ * goes out as a single writev once the buffer or the iovec array is full */
+class cpio_writer {
+public:
+	cpio_writer(out_stream &os) : os(os) {}
+
+	void copy(const void *p, size_t len) {
+		if (len == 0)
+			return;
+		if (cnt && (char *) iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == buf + used) {
+			iov[cnt - 1].iov_len += len;
+		} else {
+			iov[cnt].iov_base = buf + used;
+			iov[cnt++].iov_len = len;
 		}
+		memcpy(buf + used, p, len);
+		used += len;
+		pos += len;
 	}
-	// Write trailer
-	sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
-			inode++, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0);
-	xwrite(fd, header, 110);
-	xwrite(fd, "TRAILER!!!\0", 11);
-	dump_align();
-	close(fd);
+
+	void ref(const void *p, size_t len) {
+		iov[cnt].iov_base = const_cast<void *>(p);
+		iov[cnt++].iov_len = len;
+		pos += len;
+	}
+
+	void data(const void *p, size_t len) {
+		if (len <= DUMP_INLINE)
+			copy(p, len);
+		else
+			ref(p, len);
+	}
+
+	void pad() {
+		static const char zeros[4] = { 0 };
+		copy(zeros, align_off(pos, 4));
+	}
+
+	/* Make sure an entry with a name of len bytes fits. At worst it takes
+	 * 5 iovecs: header, name, pad, data and pad when name and data are refs */
+	void reserve(size_t len) {
+		if (cnt + 5 > DUMP_IOV || used + sizeof(cpio_newc_header) + len + DUMP_INLINE + 8 > DUMP_BUF)
+			flush();
+	}
+
+	size_t flush() {
+		if (cnt)
+			os.writev(iov, cnt);
+		cnt = 0;
+		used = 0;
+		return pos;
+	}
+
+private:
+	out_stream &os;
+	struct iovec iov[DUMP_IOV];
+	int cnt = 0;
+	char buf[DUMP_BUF];
+	size_t used = 0;
+	size_t pos = 0;
+};
+
+static void hex8(char *out, uint32_t val) {
+	static const char digits[] = "0123456789abcdef";
+	for (int i = 7; i >= 0; --i, val >>= 4)
+		out[i] = digits[val & 0xf];
 }
 
-int cpio::find(const char *name) {
-	for (int i = 0; i < arr.size(); ++i) {
-		if (!arr[i])
-			continue;
-		if (arr[i]->filename == name)
-			return i;
+static void write_header(cpio_writer &w, uint32_t ino, uint32_t mode, uint32_t uid,
+		uint32_t gid, uint32_t filesize, uint32_t namesize) {
+	const uint32_t fields[] = {
+		ino,
+		mode,
+		uid,
+		gid,
+		1,          // nlink
+		0,          // mtime
+		filesize,
+		0,          // devmajor
+		0,          // devminor
+		0,          // rdevmajor
+		0,          // rdevminor
+		namesize,
+		0           // check
+	};
+	char header[sizeof(cpio_newc_header)];
+	memcpy(header, "070701", 6);
+	for (int i = 0; i < 13; ++i)
+		hex8(header + 6 + i * 8, fields[i]);
+	w.copy(header, sizeof(header));
+}
+
+size_t cpio::dump(out_stream &os) {
+	prof_scope prof(PROF_DUMP);
+	// Keep the writer and its buffer off the stack
+	auto w = new cpio_writer(os);
+	unsigned inode = 300000;
+	for (auto &e : arr) {
+		size_t namesize = e->filename.size();
+		w->reserve(namesize <= DUMP_INLINE ? namesize : 0);
+		write_header(*w, inode++, e->mode, e->uid, e->gid, e->filesize, namesize);
+		w->data(e->filename, namesize);
+		w->pad();
+		if (e->filesize) {
+			w->data(e->data, e->filesize);
+			w->pad();
+		}
 	}
-	return -1;
+	// Write trailer
+	w->reserve(11);
+	write_header(*w, inode++, 0, 0, 0, 0, 11);
+	w->copy("TRAILER!!!\0", 11);
+	w->pad();
+	size_t total = w->flush();
+	delete w;
+	prof.set_out(total);
+	return total;
 }
 
 void cpio::insert(cpio_entry *e) {
-	int i = find(e->filename);
-	if (i >= 0) {
-		delete arr[i];
-		arr[i] = e;
+	size_t pos = lower_bound(e->filename);
+	if (cpio_entry *old = find(e->filename)) {
+		index_del(old);
+		delete old;
+		arr[pos] = e;
 	} else {
 		arr.push_back(e);
+		for (size_t i = arr.size() - 1; i > pos; --i)
+			arr[i] = arr[i - 1];
+		arr[pos] = e;
 	}
+	index_add(e);
 }
 
-void cpio::insert(Array<cpio_entry *> &arr) {
-	for (auto &e : arr)
-		insert(e);
+// Replace existing entries in place, then merge all new ones in one pass
+void cpio::insert(Array<cpio_entry *> &list) {
+	Array<new_entry> add;
+	for (size_t i = 0; i < list.size(); ++i) {
+		if (find(list[i]->filename))
+			insert(list[i]);
+		else
+			add.push_back({ list[i], i });
+	}
+	if (add.empty())
+		return;
+	add.sort();
+	// arr only grows after the merge, so make room for all of them up front
+	while (table_size <= arr.size() + add.size())
+		rehash();
+	Array<cpio_entry *> merged;
+	size_t i = 0, j = 0;
+	while (i < arr.size() || j < add.size()) {
+		if (j == add.size() || (i < arr.size() && arr[i]->filename.compare(add[j].e->filename) < 0)) {
+			merged.push_back(arr[i++]);
+		} else {
+			// Duplicates within the list itself, the last one wins
+			if (j + 1 < add.size() && add[j].e->filename == add[j + 1].e->filename) {
+				delete add[j++].e;
+				continue;
+			}
+			index_add(add[j].e);
+			merged.push_back(add[j++].e);
+		}
+	}
+	arr = utils::move(merged);
 }
 
 void cpio::rm(const char *name, bool r) {
-	size_t len = strlen(name);
-	for (auto &e : arr) {
-		if (!e)
-			continue;
-		if (e->filename.compare(name, len) == 0 &&
-			((r && e->filename[len] == '/') || e->filename[len] == '\0')) {
-			fprintf(stderr, "Remove [%s]\n", e->filename.c_str());
-			delete e;
-			e = nullptr;
-			if (!r)
-				return;
-		}
+	if (cpio_entry *e = find(name)) {
+		fprintf(stderr, "Remove [%s]\n", e->filename.c_str());
+		size_t pos = lower_bound(name);
+		erase(pos, pos + 1);
 	}
+	if (!r)
+		return;
+	size_t begin, end;
+	subtree(name, begin, end);
+	for (size_t i = begin; i < end; ++i)
+		fprintf(stderr, "Remove [%s]\n", arr[i]->filename.c_str());
+	erase(begin, end);
 }
 
 void cpio::makedir(mode_t mode, const char *name) {
@@ -187,8 +500,12 @@ void cpio::ln(const char *target, const char *name) {
 	fprintf(stderr, "Create symlink [%s] -> [%s]\n", name, target);
 }
 
-void cpio::add(mode_t mode, const char *name, const char *file) {
-	int fd = xopen(file, O_RDONLY);
+bool cpio::add(mode_t mode, const char *name, const char *file) {
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		soft_error("Cannot open [%s]\n", file);
+		return false;
+	}
 	auto e = new cpio_entry();
 	e->mode = S_IFREG | mode;
 	e->filename = name;
@@ -199,21 +516,122 @@ void cpio::add(mode_t mode, const char *name, const char *file) {
 	close(fd);
 	insert(e);
 	fprintf(stderr, "Add entry [%s] (%04o)\n", name, mode);
+	return true;
 }
 
-bool cpio::mv(const char *from, const char *to) {
-	int f = find(from), t = find(to);
-	if (f >= 0) {
-		if (t > 0) {
-			delete arr[t];
-			arr[t] = nullptr;
+struct tree_file {
+	cpio_entry *e;
+	char *path;
+};
+
+/* Create entries for everything below path, named after name. Payloads of
+ * regular files are not read here, they are queued in files instead */
+static void collect_tree(char *path, char *name, int mode,
+		Array<cpio_entry *> &list, Array<tree_file> &files) {
+	DIR *dir = xopendir(path);
+	if (dir == nullptr)
+		return;
+	size_t plen = strlen(path), nlen = strlen(name);
+	struct dirent *entry;
+	struct stat st;
+	while ((entry = xreaddir(dir))) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		snprintf(path + plen, PATH_MAX - plen, "/%s", entry->d_name);
+		snprintf(name + nlen, PATH_MAX - nlen, nlen ? "/%s" : "%s", entry->d_name);
+		if (xlstat(path, &st))
+			continue;
+		auto e = new cpio_entry();
+		e->filename = name;
+		if (S_ISDIR(st.st_mode)) {
+			// Directories also get search permission wherever they are readable
+			e->mode = S_IFDIR | (mode < 0 ? st.st_mode & 07777 : mode | (mode & 0444) >> 2);
+			list.push_back(e);
+			collect_tree(path, name, mode, list, files);
+		} else if (S_ISREG(st.st_mode)) {
+			e->mode = S_IFREG | (mode < 0 ? st.st_mode & 07777 : mode);
+			e->filesize = st.st_size;
+			list.push_back(e);
+			files.push_back({ e, strdup(path) });
+		} else if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			e->mode = S_IFLNK;
+			e->filesize = xreadlink(path, target, sizeof(target) - 1);
+			e->data = strdup(target);
+			list.push_back(e);
+		} else {
+			// Device nodes, sockets and fifos have no place in a ramdisk
+			delete e;
 		}
-		fprintf(stderr, "Move [%s] -> [%s]\n", from, to);
-		arr[f]->filename = to;
-		return true;
 	}
-	fprintf(stderr, "Cannot find entry %s\n", from);
-	return false;
+	path[plen] = '\0';
+	name[nlen] = '\0';
+	closedir(dir);
+}
+
+bool cpio::addtree(int mode, const char *dir, const char *prefix) {
+	if (access(dir, R_OK | X_OK) != 0) {
+		soft_error("Cannot open [%s]\n", dir);
+		return false;
+	}
+	char path[PATH_MAX], name[PATH_MAX];
+	snprintf(path, sizeof(path), "%s", dir);
+	snprintf(name, sizeof(name), "%s", prefix);
+	// Entries are never named with a leading or trailing slash
+	for (size_t len = strlen(name); len && name[len - 1] == '/'; --len)
+		name[len - 1] = '\0';
+	if (strcmp(name, ".") == 0 || name[0] == '/')
+		memmove(name, name + 1, strlen(name));
+
+	Array<cpio_entry *> list;
+	Array<tree_file> files;
+	if (name[0]) {
+		auto e = new cpio_entry();
+		e->filename = name;
+		e->mode = S_IFDIR | (mode < 0 ? 0755 : mode | (mode & 0444) >> 2);
+		list.push_back(e);
+	}
+	collect_tree(path, name, mode, list, files);
+
+	// Reading payloads is what takes time, do it concurrently
+	parallel_for(files.size(), [&](size_t i) {
+		auto &f = files[i];
+		int fd = xopen(f.path, O_RDONLY | O_CLOEXEC);
+		f.e->data = xmalloc(f.e->filesize);
+		xxread(fd, f.e->data, f.e->filesize);
+		close(fd);
+		free(f.path);
+	});
+
+	fprintf(stderr, "Add tree [%s] to [%s] (%zu entries)\n", dir, name, list.size());
+	insert(list);
+	return true;
+}
+
+bool cpio::mv(const char *from, const char *to) {
+	cpio_entry *e = find(from);
+	if (e == nullptr) {
+		fprintf(stderr, "Cannot find entry %s\n", from);
+		return false;
+	}
+	fprintf(stderr, "Move [%s] -> [%s]\n", from, to);
+	// to may point into the name that is about to change
+	CharArray dest(to);
+	if (cpio_entry *t = find(dest)) {
+		if (t == e)
+			return true;
+		size_t pos = lower_bound(dest);
+		erase(pos, pos + 1);
+	}
+	size_t pos = lower_bound(e->filename);
+	index_del(e);
+	size_t n = arr.size();
+	for (size_t i = pos + 1; i < n; ++i)
+		arr[i - 1] = arr[i];
+	arr.pop_back();
+	e->filename = utils::move(dest);
+	insert(e);
+	return true;
 }
 
 static void extract_entry(cpio_entry *e, const char *file) {
@@ -237,26 +655,23 @@ static void extract_entry(cpio_entry *e, const char *file) {
 }
 
 void cpio::extract() {
+	// Entries are sorted, so parents are always created before their children
+	Array<cpio_entry *> rest;
 	for (auto &e : arr) {
-		if (!e)
-			continue;
-		extract_entry(e, e->filename);
+		if (S_ISDIR(e->mode))
+			extract_entry(e, e->filename);
+		else
+			rest.push_back(e);
 	}
+	// With all directories in place, the rest can be written in any order
+	parallel_for(rest.size(), [&](size_t i) { extract_entry(rest[i], rest[i]->filename); });
 }
 
 bool cpio::extract(const char *name, const char *file) {
-	int i = find(name);
-	if (i > 0) {
-		auto e = arr[i];
+	if (cpio_entry *e = find(name)) {
 		extract_entry(e, file);
 		return true;
 	}
 	fprintf(stderr, "Cannot find the file entry [%s]\n", name);
 	return false;
 }
-
-void cpio::sort() {
-	arr.sort();
-	while (arr.back() == nullptr)
-		arr.pop_back();
-}
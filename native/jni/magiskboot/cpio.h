@@ -5,6 +5,7 @@
 
 #include "array.h"
 #include "CharArray.h"
+#include "stream.h"
 
 struct cpio_newc_header {
 	char magic[6];
@@ -23,6 +24,16 @@ struct cpio_newc_header {
 	char check[8];
 } __attribute__((packed));
 
+// Storage of a loaded archive, shared by all entries still pointing into it
+struct cpio_map {
+	void *buf;
+	size_t size;
+	bool mapped;
+	int ref;
+
+	void release();
+};
+
 struct cpio_entry {
 	// uint32_t ino;
 	uint32_t mode = 0;
@@ -40,31 +51,61 @@ struct cpio_entry {
 //	char *filename = nullptr;
 	CharArray filename;
 	void *data = nullptr;
+	// Set while data points into a loaded archive instead of the heap
+	cpio_map *map = nullptr;
+	// Next entry in the same bucket of the name index
+	cpio_entry *next = nullptr;
 
 	cpio_entry() {}
-	cpio_entry(int fd, cpio_newc_header &header);
+	// bad is set if a field of header is not hex
+	cpio_entry(const cpio_newc_header &header, bool &bad);
 	~cpio_entry();
+	// Copy data to the heap before modifying it
+	void detach();
 };
 
+/* Entries are kept sorted by name, with a hash index on top for lookups.
+ * All entries below a directory are a contiguous range in arr. */
 class cpio {
 public:
-	cpio(const char *filename);
-	~cpio();
+	virtual ~cpio();
+	// A missing file is an empty archive. Returns false if it is corrupted
+	bool load(const char *filename);
+	// The caller has to keep buf around for as long as this cpio lives
+	bool load(const void *buf, size_t size);
 	void dump(const char *file);
-	int find(const char *name);
+	size_t dump(out_stream &os);
+	cpio_entry *find(const char *name);
 	void insert(cpio_entry *e);
 	void rm(const char *name, bool r = false);
 	void makedir(mode_t mode, const char *name);
 	void ln(const char *target, const char *name);
-	void add(mode_t mode, const char *name, const char *file);
-	void insert(Array<cpio_entry *> &arr);
+	// Returns false if file cannot be read
+	bool add(mode_t mode, const char *name, const char *file);
+	// Add everything below dir with prefix, mode < 0 keeps permissions on disk
+	bool addtree(int mode, const char *dir, const char *prefix);
+	void insert(Array<cpio_entry *> &list);
 	bool mv(const char *from, const char *to);
 	void extract();
 	bool extract(const char *name, const char *file);
-	void sort();
 
 protected:
 	Array<cpio_entry *> arr;
+
+	bool parse(cpio_map *map);
+	size_t lower_bound(const char *name);
+	// Entries below dir are arr[begin, end)
+	void subtree(const char *dir, size_t &begin, size_t &end);
+	void erase(size_t begin, size_t end);
+
+private:
+	cpio_entry **table = nullptr;
+	size_t table_size = 0;
+
+	cpio_entry **bucket(const char *name);
+	void index_add(cpio_entry *e);
+	void index_del(cpio_entry *e);
+	void rehash();
 };
 
 #endif
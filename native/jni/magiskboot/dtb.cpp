@@ -5,8 +5,29 @@ extern "C" {
 }
 
 #include "magiskboot.h"
+#include "parallel.h"
 #include "utils.h"
 
+// Android dtbo / dt table image, all fields are big endian
+struct dt_table_header {
+	uint32_t magic;
+	uint32_t total_size;
+	uint32_t header_size;
+	uint32_t dt_entry_size;
+	uint32_t dt_entry_count;
+	uint32_t dt_entries_offset;
+	uint32_t page_size;
+	uint32_t version;
+} __attribute__((packed));
+
+struct dt_table_entry {
+	uint32_t dt_size;
+	uint32_t dt_offset;
+	uint32_t id;
+	uint32_t rev;
+	uint32_t custom[4];
+} __attribute__((packed));
+
 static void print_props(const void *fdt, int node, int depth) {
 	int prop;
 	fdt_for_each_property_offset(prop, fdt, node) {
@@ -41,62 +62,130 @@ static int find_fstab(const void *fdt, int parent) {
 	return -1;
 }
 
+bool check_dtb(const void *fdt, size_t left, size_t off) {
+	auto buf = (const uint8_t *) fdt;
+	if (left < sizeof(fdt_header)) {
+		fprintf(stderr, "Invalid DTB detection at 0x%x: truncated header\n", (unsigned) off);
+		return false;
+	}
+
+	// Check that fdt_header.totalsize does not overflow the buffer
+	uint32_t dt_sz = fdt_totalsize(buf);
+	if (dt_sz > left) {
+		fprintf(stderr, "Invalid DTB detection at 0x%x: size (%u) > remaining (%u)\n",
+				(unsigned) off, dt_sz, (unsigned) left);
+		return false;
+	}
+
+	// A DTB is at least its header, callers skip over it by its size
+	if (dt_sz < sizeof(fdt_header)) {
+		fprintf(stderr, "Invalid DTB detection at 0x%x: size (%u) < header\n",
+				(unsigned) off, dt_sz);
+		return false;
+	}
+
+	// Check that fdt_header.off_dt_struct does not overflow the DTB
+	uint32_t dt_struct_offset = fdt_off_dt_struct(buf);
+	if (dt_struct_offset > dt_sz - 4) {
+		fprintf(stderr, "Invalid DTB detection at 0x%x: "
+						"struct offset (%u) > size (%u)\n",
+				(unsigned) off, dt_struct_offset, dt_sz);
+		return false;
+	}
+
+	// Check that fdt_node_header.tag of first node is FDT_BEGIN_NODE
+	uint32_t dt_begin_node = fdt32_to_cpu(*(uint32_t *)(buf + dt_struct_offset));
+	if (dt_begin_node != FDT_BEGIN_NODE) {
+		fprintf(stderr, "Invalid DTB detection at 0x%x: "
+						"header tag of first node != FDT_BEGIN_NODE\n", (unsigned) off);
+		return false;
+	}
+	return true;
+}
+
+// Collect all valid DTBs, either listed in a dt table or simply concatenated
+static void index_dtbs(uint8_t *buf, size_t size, Array<uint8_t *> &dtbs) {
+	if (size >= sizeof(dt_table_header) && memcmp(buf, DTBO_MAGIC, 4) == 0) {
+		auto hdr = (dt_table_header *) buf;
+		uint32_t count = fdt32_to_cpu(hdr->dt_entry_count);
+		uint32_t entry_size = fdt32_to_cpu(hdr->dt_entry_size);
+		size_t off = fdt32_to_cpu(hdr->dt_entries_offset);
+		fprintf(stderr, "DT_TABLE        [%u]\n", count);
+		for (uint32_t i = 0; i < count && off + sizeof(dt_table_entry) <= size; ++i, off += entry_size) {
+			auto entry = (dt_table_entry *) (buf + off);
+			size_t dt_off = fdt32_to_cpu(entry->dt_offset);
+			size_t dt_size = fdt32_to_cpu(entry->dt_size);
+			// Compressed entries in version 1 tables do not start with the magic
+			if (dt_off + dt_size > size || dt_size < 4 || memcmp(buf + dt_off, DTB_MAGIC, 4))
+				continue;
+			if (check_dtb(buf + dt_off, dt_size, dt_off))
+				dtbs.push_back(buf + dt_off);
+		}
+		return;
+	}
+	for (uint8_t *fdt = buf; (fdt = (uint8_t *) memfind(fdt, buf + size - fdt, DTB_MAGIC, 4));) {
+		if (check_dtb(fdt, buf + size - fdt, fdt - buf)) {
+			dtbs.push_back(fdt);
+			// A valid DTB is never searched for more magic
+			fdt += fdt_totalsize(fdt);
+		} else {
+			++fdt;
+		}
+	}
+}
+
 static void dtb_dump(const char *file) {
 	size_t size ;
-	uint8_t *dtb, *fdt;
+	uint8_t *dtb;
 	fprintf(stderr, "Loading dtbs from [%s]\n", file);
 	mmap_ro(file, (void **) &dtb, &size);
+	Array<uint8_t *> dtbs;
+	index_dtbs(dtb, size, dtbs);
 	// Loop through all the dtbs
-	int dtb_num = 0;
-	for (int i = 0; i < size; ++i) {
-		if (memcmp(dtb + i, DTB_MAGIC, 4) == 0) {
-			fdt = dtb + i;
-			fprintf(stderr, "Dumping dtb.%04d\n", dtb_num++);
-			print_subnode(fdt, 0, 0);
-		}
+	for (size_t i = 0; i < dtbs.size(); ++i) {
+		fprintf(stderr, "Dumping dtb.%04d\n", (int) i);
+		print_subnode(dtbs[i], 0, 0);
 	}
 	fprintf(stderr, "\n");
 	munmap(dtb, size);
 	exit(0);
 }
 
-static void dtb_patch(const char *file, int patch) {
+int dtb_patch(const char *file, bool patch) {
 	size_t size ;
-	uint8_t *dtb, *fdt;
+	uint8_t *dtb;
 	fprintf(stderr, "Loading dtbs from [%s]\n", file);
 	if (patch)
 		mmap_rw(file, (void **) &dtb, &size);
 	else
 		mmap_ro(file, (void **) &dtb, &size);
-	// Loop through all the dtbs
-	int dtb_num = 0, found = 0;
-	for (int i = 0; i < size; ++i) {
-		if (memcmp(dtb + i, DTB_MAGIC, 4) == 0) {
-			fdt = dtb + i;
-			int fstab = find_fstab(fdt, 0);
-			if (fstab > 0) {
-				fprintf(stderr, "Found fstab in dtb.%04d\n", dtb_num++);
-				int block;
-				fdt_for_each_subnode(block, fdt, fstab) {
-					fprintf(stderr, "Found block [%s] in fstab\n", fdt_get_name(fdt, block, NULL));
-					uint32_t value_size;
-					void *value = (void *) fdt_getprop(fdt, block, "fsmgr_flags", (int *)&value_size);
-					if (patch) {
-						void *dup = xmalloc(value_size);
-						memcpy(dup, value, value_size);
-						memset(value, 0, value_size);
-						found |= patch_verity(&dup, &value_size, 1);
-						memcpy(value, dup, value_size);
-						free(dup);
-					} else {
-						found |= patch_verity(&value, &value_size, 0);
-					}
-				}
-			}
+	Array<uint8_t *> dtbs;
+	index_dtbs(dtb, size, dtbs);
+	// DTBs do not overlap, patch all of them concurrently
+	int found = 0;
+	parallel_for(dtbs.size(), [&](size_t i) {
+		void *fdt = dtbs[i];
+		int fstab = find_fstab(fdt, 0);
+		if (fstab <= 0)
+			return;
+		fprintf(stderr, "Found fstab in dtb.%04d\n", (int) i);
+		int block;
+		fdt_for_each_subnode(block, fdt, fstab) {
+			fprintf(stderr, "Found block [%s] in fstab\n", fdt_get_name(fdt, block, NULL));
+			int value_size;
+			void *value = fdt_getprop_w(fdt, block, "fsmgr_flags", &value_size);
+			if (value == nullptr)
+				continue;
+			// Removing flags never grows the value, so it is edited right in the mapping
+			uint32_t new_size = value_size;
+			if (patch_fstab(&value, &new_size, FSTAB_VERITY, patch))
+				__atomic_store_n(&found, 1, __ATOMIC_RELAXED);
+			if (patch)
+				memset((char *) value + new_size, 0, value_size - new_size);
 		}
-	}
+	});
 	munmap(dtb, size);
-	exit(!found);
+	return found;
 }
 
 int dtb_commands(const char *cmd, int argc, char *argv[]) {
@@ -104,9 +193,9 @@ int dtb_commands(const char *cmd, int argc, char *argv[]) {
 	if (strcmp(cmd, "dump") == 0)
 		dtb_dump(argv[0]);
 	else if (strcmp(cmd, "patch") == 0)
-		dtb_patch(argv[0], 1);
+		exit(!dtb_patch(argv[0], true));
 	else if (strcmp(cmd, "test") == 0)
-		dtb_patch(argv[0], 0);
+		exit(!dtb_patch(argv[0], false));
 	return 0;
 }
 
@@ -36,6 +36,8 @@ format_t check_fmt(const void *buf, size_t len) {
 		return DHTB;
 	} else if (MATCH(TEGRABLOB_MAGIC)) {
 		return BLOB;
+	} else if (MATCH(SPARSE_MAGIC)) {
+		return SPARSE;
 	} else {
 		return UNKNOWN;
 	}
@@ -77,6 +79,9 @@ void get_fmt_name(format_t fmt, char *name) {
 		case DTB:
 			s = "dtb";
 			break;
+		case SPARSE:
+			s = "sparse";
+			break;
 		default:
 			s = "raw";
 	}
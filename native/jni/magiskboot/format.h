@@ -17,7 +17,8 @@ typedef enum {
 	MTK,
 	DTB,
 	DHTB,
-	BLOB
+	BLOB,
+	SPARSE
 } format_t;
 
 #define COMPRESSED(fmt)  (fmt >= GZIP && fmt <= LZ4_LEGACY)
@@ -34,18 +35,20 @@ typedef enum {
 #define LZ4_LEG_MAGIC   "\x02\x21\x4c\x18"
 #define MTK_MAGIC       "\x88\x16\x88\x58"
 #define DTB_MAGIC       "\xd0\x0d\xfe\xed"
+#define DTBO_MAGIC      "\xd7\xb7\xab\x1e"
 #define LG_BUMP_MAGIC   "\x41\xa9\xe4\x67\x74\x4d\x1d\x1b\xa4\x29\xf2\xec\xea\x65\x52\x79"
 #define DHTB_MAGIC      "\x44\x48\x54\x42\x01\x00\x00\x00"
 #define SEANDROID_MAGIC "SEANDROIDENFORCE"
 #define TEGRABLOB_MAGIC "-SIGNED-BY-SIGNBLOB-"
+#define SPARSE_MAGIC    "\x3a\xff\x26\xed"
 #define NOOKHD_MAGIC    "Green Loader"
 #define NOOKHD_NEW_MAGIC "eMMC boot.img+secondloader"
 #define NOOKHD_PRE_HEADER_SZ 1048576
 #define ACCLAIM_MAGIC   "BauwksBoot"
 #define ACCLAIM_PRE_HEADER_SZ 262144
 
-#define SUP_LIST      ((const char *[]) { "gzip", "xz", "lzma", "bzip2", "lz4", "lz4_legacy", NULL })
-#define SUP_EXT_LIST  ((const char *[]) { "gz", "xz", "lzma", "bz2", "lz4", "lz4", NULL })
+#define SUP_LIST      ((const char *[]) { "gzip", "xz", "lzma", "bzip2", "lz4", "lz4_legacy", "sparse", NULL })
+#define SUP_EXT_LIST  ((const char *[]) { "gz", "xz", "lzma", "bz2", "lz4", "lz4", "sparse", NULL })
 
 format_t check_fmt(const void *buf, size_t len);
 void get_fmt_name(format_t fmt, char *name);
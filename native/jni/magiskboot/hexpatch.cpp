@@ -5,34 +5,177 @@
 
 #include "magiskboot.h"
 #include "utils.h"
+#include "logging.h"
 
-static void hex2byte(uint8_t *hex, uint8_t *str) {
-	char high, low;
-	for (int i = 0, length = strlen((char *) hex); i < length; i += 2) {
-		high = toupper(hex[i]) - '0';
-		low = toupper(hex[i + 1]) - '0';
-		str[i / 2] = ((high > 9 ? high - 7 : high) << 4) + (low > 9 ? low - 7 : low);
+struct hex_patch {
+	const char *from;
+	const char *to;
+	uint8_t *pattern;
+	// Nibbles of pattern that have to match, '?' ones are 0
+	uint8_t *mask;
+	size_t len;
+	uint8_t *patch;
+	// Nibbles of the original kept where patch has '?'
+	uint8_t *keep;
+	size_t patch_len;
+	// Longest run of fixed bytes in pattern, this is what gets searched for
+	size_t anchor;
+	size_t anchor_len;
+	int count;
+};
+
+static uint8_t nibble(const char *hex, char c) {
+	if (isdigit(c))
+		return c - '0';
+	if (isxdigit(c))
+		return toupper(c) - 'A' + 10;
+	LOGE("Invalid hex pattern [%s]\n", hex);
+	return 0;
+}
+
+// '?' stands for any nibble: it is left out of mask and is 0 in bytes
+static size_t hex2byte(const char *hex, uint8_t *&bytes, uint8_t *&mask) {
+	size_t len = strlen(hex);
+	if (len % 2)
+		LOGE("Invalid hex pattern [%s]\n", hex);
+	len /= 2;
+	bytes = (uint8_t *) xmalloc(len);
+	mask = (uint8_t *) xmalloc(len);
+	for (size_t i = 0; i < len; ++i) {
+		bytes[i] = mask[i] = 0;
+		for (int j = 0; j < 2; ++j) {
+			char c = hex[i * 2 + j];
+			bytes[i] <<= 4;
+			mask[i] <<= 4;
+			if (c != '?') {
+				bytes[i] |= nibble(hex, c);
+				mask[i] |= 0xf;
+			}
+		}
+	}
+	return len;
+}
+
+static void add_patch(Array<hex_patch> &patches, const char *from, const char *to) {
+	hex_patch p {};
+	p.from = from;
+	p.to = to;
+	p.len = hex2byte(from, p.pattern, p.mask);
+	p.patch_len = hex2byte(to, p.patch, p.keep);
+	for (size_t i = 0; i < p.patch_len; ++i)
+		p.keep[i] = ~p.keep[i];
+	for (size_t i = 0, run = 0; i < p.len; ++i) {
+		run = p.mask[i] == 0xff ? run + 1 : 0;
+		if (run > p.anchor_len) {
+			p.anchor = i + 1 - run;
+			p.anchor_len = run;
+		}
+	}
+	if (p.anchor_len == 0)
+		LOGE("Pattern [%s] needs at least one fixed byte\n", from);
+	patches.push_back(p);
+}
+
+static bool match(const uint8_t *buf, size_t left, const hex_patch &p) {
+	if (p.len > left)
+		return false;
+	for (size_t i = 0; i < p.len; ++i) {
+		if ((buf[i] & p.mask[i]) != p.pattern[i])
+			return false;
 	}
+	return true;
 }
 
-void hexpatch(const char *image, const char *from, const char *to) {
-	int patternsize = strlen(from) / 2, patchsize = strlen(to) / 2;
+static void apply(uint8_t *buf, size_t left, const hex_patch &p) {
+	size_t i = 0;
+	for (; i < p.patch_len && i < left; ++i)
+		buf[i] = (buf[i] & p.keep[i]) | p.patch[i];
+	// Whatever the pattern covered beyond the patch is cleared
+	for (; i < p.len; ++i)
+		buf[i] = 0;
+}
+
+/* Arguments are either pairs of <from> <to> hex patterns, or -f <file> with
+ * one pair per line. All pairs are applied in a single pass over the file;
+ * patches never overlap, the match that starts first wins, or the pair listed
+ * first if several start at the same offset. */
+int hexpatch(const char *image, int argc, char *argv[]) {
+	Array<CharArray> lines;
+	Array<hex_patch> patches;
+	if (argc == 2 && strcmp(argv[0], "-f") == 0) {
+		if (file_to_array(argv[1], lines))
+			LOGE("Cannot read patch list [%s]\n", argv[1]);
+		for (auto &line : lines) {
+			char *from = strtok(line, " \t\r");
+			char *to = strtok(nullptr, " \t\r");
+			if (from == nullptr || from[0] == '#')
+				continue;
+			if (to == nullptr)
+				LOGE("No replacement for [%s]\n", from);
+			add_patch(patches, from, to);
+		}
+	} else if (argc > 0 && argc % 2 == 0) {
+		for (int i = 0; i < argc; i += 2)
+			add_patch(patches, argv[i], argv[i + 1]);
+	} else {
+		return 1;
+	}
+
+	Array<mem_needle> anchors;
+	size_t max_anchor = 0;
+	for (auto &p : patches) {
+		anchors.push_back({ p.pattern + p.anchor, p.anchor_len });
+		if (p.anchor > max_anchor)
+			max_anchor = p.anchor;
+	}
+
 	size_t filesize;
-	uint8_t *file, *pattern, *patch;
+	uint8_t *file;
 	mmap_rw(image, (void **) &file, &filesize);
-	pattern = (uint8_t *) xmalloc(patternsize);
-	patch = (uint8_t *) xmalloc(patchsize);
-	hex2byte((uint8_t *) from, pattern);
-	hex2byte((uint8_t *) to, patch);
-	for (size_t i = 0; filesize > 0 && i < filesize - patternsize; ++i) {
-		if (memcmp(file + i, pattern, patternsize) == 0) {
-			fprintf(stderr, "Patch @ %08X [%s]->[%s]\n", (unsigned) i, from, to);
-			memset(file + i, 0, patternsize);
-			memcpy(file + i, patch, patchsize);
-			i += patternsize - 1;
+	/* Anchors are found in file order, but a pattern can start up to max_anchor
+	 * bytes before its anchor. The earliest match is only applied once no other
+	 * one can start before it, and nothing before end is matched again. */
+	size_t pos = 0, end = 0;
+	hex_patch *best = nullptr;
+	size_t best_start = 0;
+	for (;;) {
+		uint8_t *found = nullptr;
+		if (pos < filesize)
+			found = (uint8_t *) memfind_any(file + pos, filesize - pos, anchors.data(), anchors.size(), nullptr);
+		size_t at = found ? found - file : filesize;
+		if (best && (found == nullptr || at > best_start + max_anchor)) {
+			fprintf(stderr, "Patch @ %08X [%s]->[%s]\n", (unsigned) best_start, best->from, best->to);
+			apply(file + best_start, filesize - best_start, *best);
+			end = best_start + (best->patch_len > best->len ? best->patch_len : best->len);
+			++best->count;
+			best = nullptr;
+			// Matches after the patch may have been passed over for this one
+			pos = end;
+			continue;
+		}
+		if (found == nullptr)
+			break;
+		for (auto &p : patches) {
+			if (at < p.anchor)
+				continue;
+			size_t start = at - p.anchor;
+			if (start < end || (best && (start > best_start || (start == best_start && &p > best))))
+				continue;
+			if (match(file + start, filesize - start, p)) {
+				best = &p;
+				best_start = start;
+			}
 		}
+		pos = at + 1;
 	}
 	munmap(file, filesize);
-	free(pattern);
-	free(patch);
+
+	for (auto &p : patches) {
+		fprintf(stderr, "[%s]->[%s]: %d patched\n", p.from, p.to, p.count);
+		free(p.pattern);
+		free(p.mask);
+		free(p.patch);
+		free(p.keep);
+	}
+	return 0;
 }
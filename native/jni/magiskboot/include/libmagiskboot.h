@@ -0,0 +1,70 @@
+/* libmagiskboot.h - Boot image patching on memory buffers
+ *
+ * Everything magiskboot --unpack, --cpio and --repack do, without files in
+ * the current directory. Handles are not thread safe, but different handles
+ * can be used on different threads at the same time.
+ *
+ * Malformed input makes mb_boot_parse, mb_boot_get, mb_cpio_load and
+ * mb_cpio_commands return an error after logging it through log_cb.e, and
+ * leaves the handles as they were. Other calls only fail when out of memory
+ * or on a bad fd, which, like in magiskboot, ends the process through
+ * log_cb.ex.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mb_boot mb_boot;
+typedef struct mb_cpio mb_cpio;
+
+typedef enum {
+	MB_KERNEL,
+	MB_DTB,
+	MB_RAMDISK,
+	MB_SECOND,
+	MB_EXTRA,
+	MB_RECV_DTBO,
+	MB_NUM_PARTS
+} mb_part;
+
+/* Parse a boot image, buf is copied. Returns NULL if there is no boot image
+ * that can be repacked in buf, such as with ELF kernels, or it is corrupted */
+mb_boot *mb_boot_parse(const void *buf, size_t size);
+void mb_boot_free(mb_boot *boot);
+
+/* Get a component, decompressed if it was compressed in the image. The buffer
+ * belongs to boot and stays valid until the component is set again. Returns -1
+ * if the image does not have the component, or it cannot be decompressed */
+int mb_boot_get(mb_boot *boot, mb_part part, const void **buf, size_t *size);
+
+/* Replace a component with a copy of buf, it will be compressed the same way
+ * as the original one. A size of 0 removes the component */
+int mb_boot_set(mb_boot *boot, mb_part part, const void *buf, size_t size);
+
+/* Repack the image to fd, returns 0 on success */
+int mb_boot_write(mb_boot *boot, int fd);
+
+/* Repack the image to a new buffer, which the caller has to free() */
+void *mb_boot_serialize(mb_boot *boot, size_t *size);
+
+/* Load a cpio archive, buf is copied. Returns NULL if it is corrupted */
+mb_cpio *mb_cpio_load(const void *buf, size_t size);
+void mb_cpio_free(mb_cpio *cpio);
+
+/* Do cpio commands as magiskboot --cpio would, each one a single string.
+ * Returns 0 when all are done, -1 if one is not known or fails, otherwise the
+ * result of a command that ends the list, like test. A failed command does
+ * not change the archive, the commands before it stay done */
+int mb_cpio_commands(mb_cpio *cpio, int argc, const char *const *argv);
+
+/* Dump the archive to a new buffer, which the caller has to free() */
+void *mb_cpio_dump(mb_cpio *cpio, size_t *size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,457 @@
+/* inflate.cpp - Single-shot gzip decoder
+ *
+ * Decodes a whole gzip member from memory into a buffer of the exact
+ * decompressed size. Because the whole output is available as window, there
+ * is no sliding window to maintain and no output flushing: matches are copied
+ * directly within the output buffer. Huffman codes are decoded with two level
+ * lookup tables, and the bit buffer is refilled with 64-bit loads.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "magiskboot.h"
+
+#define LITLEN_BITS  10
+#define DIST_BITS    8
+#define PRECODE_BITS 7
+#define MAX_BITS     15
+
+#define LITLEN_SYMS  288
+#define DIST_SYMS    32
+#define PRECODE_SYMS 19
+
+// Root table plus room for all subtables
+#define LITLEN_ENOUGH  ((1 << LITLEN_BITS) + 2048)
+#define DIST_ENOUGH    ((1 << DIST_BITS) + 1024)
+
+/* Table entry layout:
+ * bits  0- 7: number of bits to consume
+ * bits  8-12: number of extra bits (for subtable pointers: subtable bits)
+ * bits 13-15: kind of entry
+ * bits 16-31: literal, base value, or subtable offset */
+enum {
+	K_LIT,
+	K_LEN,
+	K_EOB,
+	K_SUB,
+	K_BAD
+};
+
+#define ENTRY(val, kind, extra, len) \
+	(((uint32_t) (val) << 16) | ((kind) << 13) | ((extra) << 8) | (len))
+#define E_LEN(e)   ((e) & 0xff)
+#define E_EXTRA(e) (((e) >> 8) & 0x1f)
+#define E_KIND(e)  (((e) >> 13) & 0x7)
+#define E_VAL(e)   ((e) >> 16)
+
+static const uint16_t len_base[] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t precode_order[] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+enum table_type {
+	T_LITLEN,
+	T_DIST,
+	T_PRECODE
+};
+
+static uint32_t sym_entry(table_type type, unsigned sym, unsigned len) {
+	switch (type) {
+		case T_LITLEN:
+			if (sym < 256)
+				return ENTRY(sym, K_LIT, 0, len);
+			if (sym == 256)
+				return ENTRY(0, K_EOB, 0, len);
+			if (sym < 286)
+				return ENTRY(len_base[sym - 257], K_LEN, len_extra[sym - 257], len);
+			return ENTRY(0, K_BAD, 0, len);
+		case T_DIST:
+			if (sym < 30)
+				return ENTRY(dist_base[sym], K_LEN, dist_extra[sym], len);
+			return ENTRY(0, K_BAD, 0, len);
+		default:
+			return ENTRY(sym, K_LIT, 0, len);
+	}
+}
+
+static unsigned bit_reverse(unsigned code, unsigned len) {
+	unsigned r = 0;
+	for (unsigned i = 0; i < len; ++i, code >>= 1)
+		r = (r << 1) | (code & 1);
+	return r;
+}
+
+/* Build a two level decode table from code lengths. Incomplete codes are
+ * accepted, unused entries decode to K_BAD. Returns false if the lengths
+ * are over-subscribed or the table does not fit */
+static bool build_table(uint32_t *table, unsigned size, unsigned bits,
+		const uint8_t *lens, unsigned num, table_type type) {
+	unsigned count[MAX_BITS + 1] = { 0 };
+	unsigned offs[MAX_BITS + 2];
+	uint16_t sorted[LITLEN_SYMS];
+
+	for (unsigned s = 0; s < num; ++s)
+		++count[lens[s]];
+	count[0] = 0;
+	int left = 1;
+	for (unsigned l = 1; l <= MAX_BITS; ++l) {
+		left = (left << 1) - count[l];
+		if (left < 0)
+			return false;
+	}
+
+	// Sort symbols by (length, symbol), this is also canonical code order
+	offs[1] = 0;
+	for (unsigned l = 1; l <= MAX_BITS; ++l)
+		offs[l + 1] = offs[l] + count[l];
+	unsigned total = offs[MAX_BITS + 1];
+	for (unsigned s = 0; s < num; ++s)
+		if (lens[s])
+			sorted[offs[lens[s]]++] = s;
+
+	unsigned root = 1U << bits;
+	for (unsigned i = 0; i < root; ++i)
+		table[i] = ENTRY(0, K_BAD, 0, 1);
+
+	unsigned next = root, code = 0, i = 0;
+	unsigned prev_len = total ? lens[sorted[0]] : 0;
+	while (i < total) {
+		unsigned len = lens[sorted[i]];
+		code <<= len - prev_len;
+		prev_len = len;
+		if (len <= bits) {
+			uint32_t e = sym_entry(type, sorted[i], len);
+			for (unsigned r = bit_reverse(code, len); r < root; r += 1U << len)
+				table[r] = e;
+			++code;
+			++i;
+			continue;
+		}
+
+		// All codes sharing the first bits are contiguous, the last one is the longest
+		unsigned prefix = code >> (len - bits);
+		unsigned j = i, c = code, l = len;
+		while (j + 1 < total) {
+			unsigned nl = lens[sorted[j + 1]];
+			unsigned nc = (c + 1) << (nl - l);
+			if (nc >> (nl - bits) != prefix)
+				break;
+			c = nc;
+			l = nl;
+			++j;
+		}
+		unsigned sub_bits = l - bits;
+		unsigned sub_size = 1U << sub_bits;
+		if (next + sub_size > size)
+			return false;
+		for (unsigned k = 0; k < sub_size; ++k)
+			table[next + k] = ENTRY(0, K_BAD, 0, 1);
+		table[bit_reverse(prefix, bits)] = ENTRY(next, K_SUB, sub_bits, bits);
+
+		for (; i <= j; ++i) {
+			len = lens[sorted[i]];
+			code <<= len - prev_len;
+			prev_len = len;
+			unsigned sub_len = len - bits;
+			uint32_t e = sym_entry(type, sorted[i], sub_len);
+			unsigned low = code & ((1U << sub_len) - 1);
+			for (unsigned r = bit_reverse(low, sub_len); r < sub_size; r += 1U << sub_len)
+				table[next + r] = e;
+			++code;
+		}
+		next += sub_size;
+	}
+	return true;
+}
+
+struct bitstream {
+	const uint8_t *in;
+	const uint8_t *end;
+	uint64_t buf;
+	unsigned cnt;
+	unsigned overrun;
+
+	/* Make sure there are at least 56 bits available. Past the end of input,
+	 * zeros are fed and counted in overrun */
+	void refill() {
+		if (end - in >= 8) {
+			uint64_t v;
+			memcpy(&v, in, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			v = __builtin_bswap64(v);
+#endif
+			buf |= v << cnt;
+			in += (63 - cnt) >> 3;
+			cnt |= 56;
+		} else {
+			while (cnt <= 56) {
+				if (in < end)
+					buf |= (uint64_t) *in++ << cnt;
+				else
+					++overrun;
+				cnt += 8;
+			}
+		}
+	}
+
+	uint32_t peek(unsigned n) const {
+		return buf & ((1ULL << n) - 1);
+	}
+
+	void consume(unsigned n) {
+		buf >>= n;
+		cnt -= n;
+	}
+
+	uint32_t pop(unsigned n) {
+		uint32_t v = peek(n);
+		consume(n);
+		return v;
+	}
+
+	// Drop to a byte boundary and give back the unused whole bytes
+	bool align() {
+		consume(cnt & 7);
+		unsigned bytes = cnt >> 3;
+		if (overrun > bytes)
+			return false;
+		in -= bytes - overrun;
+		buf = 0;
+		cnt = 0;
+		overrun = 0;
+		return true;
+	}
+};
+
+static inline uint32_t decode(bitstream &bs, const uint32_t *table, unsigned bits) {
+	uint32_t e = table[bs.peek(bits)];
+	if (E_KIND(e) == K_SUB) {
+		bs.consume(bits);
+		e = table[E_VAL(e) + bs.peek(E_EXTRA(e))];
+	}
+	bs.consume(E_LEN(e));
+	return e;
+}
+
+static bool read_dynamic(bitstream &bs, uint32_t *litlen, uint32_t *dist) {
+	uint8_t lens[LITLEN_SYMS + DIST_SYMS] = { 0 };
+	uint8_t pre_lens[PRECODE_SYMS] = { 0 };
+	uint32_t precode[1 << PRECODE_BITS];
+
+	bs.refill();
+	unsigned nlit = bs.pop(5) + 257;
+	unsigned ndist = bs.pop(5) + 1;
+	unsigned npre = bs.pop(4) + 4;
+	if (nlit > 286 || ndist > 30)
+		return false;
+	for (unsigned i = 0; i < npre; ++i) {
+		bs.refill();
+		pre_lens[precode_order[i]] = bs.pop(3);
+	}
+	if (!build_table(precode, 1 << PRECODE_BITS, PRECODE_BITS, pre_lens, PRECODE_SYMS, T_PRECODE))
+		return false;
+
+	for (unsigned i = 0; i < nlit + ndist;) {
+		bs.refill();
+		uint32_t e = decode(bs, precode, PRECODE_BITS);
+		if (E_KIND(e) == K_BAD)
+			return false;
+		unsigned sym = E_VAL(e), rep;
+		uint8_t val = 0;
+		if (sym < 16) {
+			lens[i++] = sym;
+			continue;
+		} else if (sym == 16) {
+			if (i == 0)
+				return false;
+			val = lens[i - 1];
+			rep = 3 + bs.pop(2);
+		} else if (sym == 17) {
+			rep = 3 + bs.pop(3);
+		} else {
+			rep = 11 + bs.pop(7);
+		}
+		if (i + rep > nlit + ndist)
+			return false;
+		memset(lens + i, val, rep);
+		i += rep;
+	}
+
+	// End of block has to be encodable
+	if (lens[256] == 0)
+		return false;
+	return build_table(litlen, LITLEN_ENOUGH, LITLEN_BITS, lens, nlit, T_LITLEN) &&
+		   build_table(dist, DIST_ENOUGH, DIST_BITS, lens + nlit, ndist, T_DIST);
+}
+
+static bool read_fixed(uint32_t *litlen, uint32_t *dist) {
+	uint8_t lens[LITLEN_SYMS];
+	memset(lens, 8, 144);
+	memset(lens + 144, 9, 112);
+	memset(lens + 256, 7, 24);
+	memset(lens + 280, 8, 8);
+	if (!build_table(litlen, LITLEN_ENOUGH, LITLEN_BITS, lens, LITLEN_SYMS, T_LITLEN))
+		return false;
+	memset(lens, 5, DIST_SYMS);
+	return build_table(dist, DIST_ENOUGH, DIST_BITS, lens, DIST_SYMS, T_DIST);
+}
+
+/* Decode the symbols of one compressed block. The bit stream is kept in a
+ * local copy, as every byte written to the output could otherwise alias it */
+static bool decode_block(bitstream &stream, const uint32_t *litlen, const uint32_t *dist,
+		uint8_t *out, uint8_t *&out_pos, uint8_t *end) {
+	bitstream bs = stream;
+	uint8_t *pos = out_pos;
+	while (true) {
+		// One refill covers the longest length and distance codes with extra bits
+		bs.refill();
+		uint32_t e = decode(bs, litlen, LITLEN_BITS);
+		unsigned kind = E_KIND(e);
+		if (kind == K_LIT) {
+			if (pos == end)
+				return false;
+			*pos++ = E_VAL(e);
+			// There are enough bits left for another literal without refilling
+			e = litlen[bs.peek(LITLEN_BITS)];
+			if (E_KIND(e) == K_LIT) {
+				if (pos == end)
+					return false;
+				bs.consume(E_LEN(e));
+				*pos++ = E_VAL(e);
+			}
+			continue;
+		} else if (kind == K_EOB) {
+			break;
+		} else if (kind != K_LEN) {
+			return false;
+		}
+		size_t length = E_VAL(e) + bs.pop(E_EXTRA(e));
+
+		e = decode(bs, dist, DIST_BITS);
+		if (E_KIND(e) != K_LEN)
+			return false;
+		size_t offset = E_VAL(e) + bs.pop(E_EXTRA(e));
+		if (offset > (size_t) (pos - out) || length > (size_t) (end - pos))
+			return false;
+
+		const uint8_t *src = pos - offset;
+		if (offset >= 8 && end - pos >= (ptrdiff_t) length + 8) {
+			// Copy in words, may write up to 7 bytes past the match
+			uint8_t *dst = pos;
+			pos += length;
+			do {
+				uint64_t v;
+				memcpy(&v, src, 8);
+				memcpy(dst, &v, 8);
+				src += 8;
+				dst += 8;
+			} while (dst < pos);
+		} else if (offset == 1) {
+			memset(pos, *src, length);
+			pos += length;
+		} else {
+			while (length--)
+				*pos++ = *src++;
+		}
+	}
+	stream = bs;
+	out_pos = pos;
+	return true;
+}
+
+static bool inflate_raw(bitstream &bs, uint8_t *out, size_t out_size) {
+	uint32_t litlen[LITLEN_ENOUGH];
+	uint32_t dist[DIST_ENOUGH];
+	uint8_t *pos = out, *end = out + out_size;
+	bool final;
+
+	do {
+		bs.refill();
+		final = bs.pop(1);
+		unsigned type = bs.pop(2);
+		if (type == 0) {
+			// Stored block
+			if (!bs.align() || bs.end - bs.in < 4)
+				return false;
+			uint16_t len = bs.in[0] | (bs.in[1] << 8);
+			uint16_t nlen = bs.in[2] | (bs.in[3] << 8);
+			bs.in += 4;
+			if (len != (uint16_t) ~nlen || len > bs.end - bs.in || len > end - pos)
+				return false;
+			memcpy(pos, bs.in, len);
+			pos += len;
+			bs.in += len;
+			continue;
+		} else if (type == 1) {
+			if (!read_fixed(litlen, dist))
+				return false;
+		} else if (type == 2) {
+			if (!read_dynamic(bs, litlen, dist))
+				return false;
+		} else {
+			return false;
+		}
+
+		if (!decode_block(bs, litlen, dist, out, pos, end))
+			return false;
+	} while (!final);
+
+	return pos == end && bs.align();
+}
+
+bool gzip_inflate(const uint8_t *buf, size_t size, uint8_t *out, size_t out_size) {
+	const uint8_t *end = buf + size;
+	if (size < 18 || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8)
+		return false;
+	uint8_t flags = buf[3];
+	const uint8_t *p = buf + 10;
+	if (flags & 0x04) {
+		// FEXTRA
+		if (end - p < 2)
+			return false;
+		p += 2 + (p[0] | (p[1] << 8));
+	}
+	if (flags & 0x08) {
+		// FNAME
+		while (p < end && *p) ++p;
+		++p;
+	}
+	if (flags & 0x10) {
+		// FCOMMENT
+		while (p < end && *p) ++p;
+		++p;
+	}
+	if (flags & 0x02) {
+		// FHCRC
+		p += 2;
+	}
+	if (p >= end)
+		return false;
+
+	bitstream bs { p, end, 0, 0, 0 };
+	if (!inflate_raw(bs, out, out_size) || end - bs.in < 8)
+		return false;
+
+	uint32_t crc, isize;
+	memcpy(&crc, bs.in, 4);
+	memcpy(&isize, bs.in + 4, 4);
+	return isize == (uint32_t) out_size && crc == crc32(crc32(0L, Z_NULL, 0), out, out_size);
+}
@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libmagiskboot.h>
+
+#include "bootimg.h"
+#include "cpio.h"
+#include "magiskboot.h"
+#include "parallel.h"
+#include "utils.h"
+#include "logging.h"
+
+static_assert((int) MB_KERNEL == KERNEL && (int) MB_DTB == DTB_PART &&
+		(int) MB_RAMDISK == RAMDISK && (int) MB_SECOND == SECOND && (int) MB_EXTRA == EXTRA &&
+		(int) MB_RECV_DTBO == RECV_DTBO && (int) MB_NUM_PARTS == NUM_PARTS,
+		"mb_part has to follow the repack parts");
+
+struct mb_boot {
+	boot_img img {};
+	// The component in the original image
+	uint8_t *orig[NUM_PARTS];
+	size_t orig_size[NUM_PARTS];
+	format_t fmt[NUM_PARTS];
+	// Replaced or decompressed contents on the heap
+	bool set[NUM_PARTS];
+	uint8_t *data[NUM_PARTS];
+	size_t size[NUM_PARTS];
+};
+
+struct mb_cpio {
+	void *buf;
+	cpio *rd;
+};
+
+static bool valid_part(int part) {
+	return part >= 0 && part < NUM_PARTS;
+}
+
+// Errors in the input are soft within a call, the parsers return them to the entry point
+struct api_scope {
+	job_error err {};
+	job_error *prev;
+
+	api_scope() : prev(soft_errors) { soft_errors = &err; }
+	~api_scope() { soft_errors = prev; }
+};
+
+mb_boot *mb_boot_parse(const void *buf, size_t size) {
+	auto boot = new mb_boot();
+	api_scope scope;
+	int ret = boot->img.parse_image(buf, size);
+	if (ret != 0 && ret != CHROMEOS_RET) {
+		delete boot;
+		return nullptr;
+	}
+	boot_img &img = boot->img;
+	uint8_t *orig[] = { img.kernel, img.dtb, img.ramdisk, img.second, img.extra, img.recov_dtbo };
+	size_t orig_size[] = { img.hdr->kernel_size, img.dt_size, img.hdr->ramdisk_size,
+			img.hdr->second_size, img.extra_size(), img.recovery_dtbo_size() };
+	for (int i = 0; i < NUM_PARTS; ++i) {
+		boot->orig[i] = orig[i];
+		boot->orig_size[i] = orig_size[i];
+		boot->fmt[i] = UNKNOWN;
+	}
+	boot->fmt[KERNEL] = img.k_fmt;
+	boot->fmt[RAMDISK] = img.r_fmt;
+	return boot;
+}
+
+void mb_boot_free(mb_boot *boot) {
+	for (auto data : boot->data)
+		free(data);
+	delete boot;
+}
+
+int mb_boot_get(mb_boot *boot, mb_part part, const void **buf, size_t *size) {
+	if (!valid_part(part))
+		return -1;
+	if (boot->set[part] || boot->data[part]) {
+		*buf = boot->data[part];
+		*size = boot->size[part];
+	} else if (COMPRESSED(boot->fmt[part]) && boot->orig_size[part]) {
+		api_scope scope;
+		// Decompressed once, then kept until the component is set
+		buf_stream os;
+		if (decompress(boot->fmt[part], os, boot->orig[part], boot->orig_size[part]) < 0)
+			return -1;
+		boot->size[part] = os.size();
+		boot->data[part] = os.release();
+		*buf = boot->data[part];
+		*size = boot->size[part];
+	} else {
+		*buf = boot->orig[part];
+		*size = boot->orig_size[part];
+	}
+	return *size ? 0 : -1;
+}
+
+int mb_boot_set(mb_boot *boot, mb_part part, const void *buf, size_t size) {
+	if (!valid_part(part))
+		return -1;
+	free(boot->data[part]);
+	boot->data[part] = nullptr;
+	if (size) {
+		boot->data[part] = (uint8_t *) xmalloc(size);
+		memcpy(boot->data[part], buf, size);
+	}
+	boot->size[part] = size;
+	boot->set[part] = true;
+	return 0;
+}
+
+void *mb_boot_serialize(mb_boot *boot, size_t *size) {
+	repack_part parts[NUM_PARTS] = {};
+	for (int i = 0; i < NUM_PARTS; ++i) {
+		repack_part &p = parts[i];
+		if (!boot->set[i]) {
+			orig_part(p, boot->orig[i], boot->orig_size[i]);
+		} else if (COMPRESSED(boot->fmt[i])) {
+			p.exist = boot->size[i] > 0;
+			p.fmt = boot->fmt[i];
+			p.raw = boot->data[i];
+			p.raw_size = boot->size[i];
+		} else {
+			orig_part(p, boot->data[i], boot->size[i]);
+		}
+	}
+	buf_stream os;
+	build_image(boot->img, parts, os);
+	*size = os.size();
+	return os.release();
+}
+
+int mb_boot_write(mb_boot *boot, int fd) {
+	size_t size;
+	void *buf = mb_boot_serialize(boot, &size);
+	ssize_t ret = xwrite(fd, buf, size);
+	free(buf);
+	return ret == (ssize_t) size ? 0 : -1;
+}
+
+mb_cpio *mb_cpio_load(const void *buf, size_t size) {
+	auto c = new mb_cpio();
+	if (size) {
+		c->buf = xmalloc(size);
+		memcpy(c->buf, buf, size);
+	}
+	api_scope scope;
+	c->rd = load_ramdisk(c->buf, size);
+	if (c->rd == nullptr) {
+		free(c->buf);
+		delete c;
+		return nullptr;
+	}
+	return c;
+}
+
+void mb_cpio_free(mb_cpio *c) {
+	delete c->rd;
+	free(c->buf);
+	delete c;
+}
+
+int mb_cpio_commands(mb_cpio *c, int argc, const char *const *argv) {
+	// Commands are split in place
+	Array<char *> cmds;
+	for (int i = 0; i < argc; ++i)
+		cmds.push_back(strdup(argv[i]));
+	int ret;
+	api_scope scope;
+	ramdisk_commands(c->rd, argc, cmds.data(), ret);
+	for (auto cmd : cmds)
+		free(cmd);
+	return ret;
+}
+
+void *mb_cpio_dump(mb_cpio *c, size_t *size) {
+	buf_stream os;
+	c->rd->dump(os);
+	*size = os.size();
+	return os.release();
+}
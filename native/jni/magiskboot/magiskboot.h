@@ -4,6 +4,9 @@
 #include <sys/types.h>
 
 #include "format.h"
+#include "stream.h"
+
+class cpio;
 
 #define KERNEL_FILE     "kernel"
 #define RAMDISK_FILE    "ramdisk.cpio"
@@ -11,28 +14,89 @@
 #define EXTRA_FILE      "extra"
 #define DTB_FILE        "dtb"
 #define RECV_DTBO_FILE  "recovery_dtbo"
+#define ORIGIN_FILE     ".origin"
 #define NEW_BOOT        "new-boot.img"
 
 // Main entries
 int unpack(const char *image);
-void repack(const char* orig_image, const char* out_image);
-void hexpatch(const char *image, const char *from, const char *to);
+// If max_size is set, compressed parts are made smaller until the image fits
+void repack(const char* orig_image, const char* out_image, size_t max_size = 0);
+/* Returns what a cpio command ending the job returned, -1 if one is not known
+ * or fails. If errors are soft, other errors return 1 instead of exiting */
+int patch(const char *in_image, const char *out_image, int argc, char *argv[]);
+// Run the patch jobs listed in manifest concurrently, returns the number that failed
+int batch(const char *manifest);
+int hexpatch(const char *image, int argc, char *argv[]);
+// Returns -1 if a command is not known
 int cpio_commands(int argc, char *argv[]);
+// Load an in-memory ramdisk, which has to outlive the result. nullptr if it is corrupted
+cpio *load_ramdisk(const void *buf, size_t size);
+/* Do cpio commands on a ramdisk from load_ramdisk. Returns false if a command
+ * ended the job, with its exit value in ret (-1: unknown or failed command) */
+bool ramdisk_commands(cpio *rd, int argc, char *argv[], int &ret);
+/* Do cpio commands on an in-memory ramdisk, which has to outlive the result.
+ * Returns nullptr if a command ended the job, with its exit value in ret,
+ * or the ramdisk is corrupted (ret -1) */
+cpio *ramdisk_commands(const void *buf, size_t size, int argc, char *argv[], int &ret);
 void compress(const char *method, const char *from, const char *to);
 void decompress(char *from, const char *to);
 int dtb_commands(const char *cmd, int argc, char *argv[]);
+// Find, or remove if patch is set, verity flags in the fstab of all dtbs in file. Returns 1 if found
+int dtb_patch(const char *file, bool patch);
+// Whether a DTB_MAGIC match with left bytes remaining is a real header, off is for logging
+bool check_dtb(const void *fdt, size_t left, size_t off);
+
+#define XZ_BLOCKSIZE    0x800000
+
+// Block size used by the multi-threaded xz encoder
+extern size_t xz_block_size;
+
+// Encoder settings, the defaults are what magiskboot always used
+struct comp_opts {
+	int level = 9;          // gzip and bzip2 level, LZ4HC level, xz and lzma preset
+	bool extreme = false;   // xz and lzma: LZMA_PRESET_EXTREME
+	int strategy = 0;       // gzip: zlib strategy, 0 is Z_DEFAULT_STRATEGY
+	bool single = false;    // gzip and xz: one stream even with several threads
+	uint32_t dict_max = 0;  // xz and lzma: cap of the dictionary size if not 0
+};
+
+struct comp_setting {
+	const char *name;
+	comp_opts opts;
+};
+
+/* Settings for type from the default to the strongest, for fitting an image
+ * into a partition. Returns the number of settings in list */
+int comp_settings(format_t type, const comp_setting *&list);
 
 // Compressions
-size_t gzip(int mode, int fd, const void *buf, size_t size);
-size_t lzma(int mode, int fd, const void *buf, size_t size);
-size_t lz4(int mode, int fd, const uint8_t *buf, size_t size);
-size_t bzip2(int mode, int fd, const void *buf, size_t size);
-size_t lz4_legacy(int mode, int fd, const uint8_t *buf, size_t size);
+// Returned by the decoders if errors are soft and the input cannot be decoded
+#define CODEC_ERR  ((size_t) -1)
+size_t gzip(int mode, out_stream &os, const void *buf, size_t size, const comp_opts &opts = comp_opts());
+size_t lzma(int mode, out_stream &os, const void *buf, size_t size, const comp_opts &opts = comp_opts());
+size_t lz4(int mode, out_stream &os, const uint8_t *buf, size_t size, const comp_opts &opts = comp_opts());
+size_t bzip2(int mode, out_stream &os, const void *buf, size_t size, const comp_opts &opts = comp_opts());
+size_t lz4_legacy(int mode, out_stream &os, const uint8_t *buf, size_t size,
+		const comp_opts &opts = comp_opts());
+// Android sparse images, blk_sz is only for encoding
+size_t sparse(int mode, out_stream &os, const void *buf, size_t size, uint32_t blk_sz = 4096);
+decoder_stream *get_sparse_decoder(out_stream &os);
 long long compress(format_t type, int fd, const void *from, size_t size);
+long long compress(format_t type, out_stream &os, const void *from, size_t size,
+		const comp_opts &opts = comp_opts());
+encoder_stream *get_encoder(format_t type, out_stream &os, const comp_opts &opts = comp_opts());
+decoder_stream *get_decoder(format_t type, out_stream &os);
+bool gzip_inflate(const uint8_t *buf, size_t size, uint8_t *out, size_t out_size);
+// Return -1 if the format is not supported, or the input cannot be decoded
 long long decompress(format_t type, int fd, const void *from, size_t size);
+long long decompress(format_t type, out_stream &os, const void *from, size_t size);
 
 // Pattern
-int patch_verity(void **buf, uint32_t *size, int patch);
-void patch_encryption(void **buf, uint32_t *size);
+#define FSTAB_VERITY   (1 << 0)
+#define FSTAB_ENCRYPT  (1 << 1)
+/* Find, or remove and replace if patch is set, the fstab flags of the given
+ * families in one pass. Edits are done in place, *buf is only reallocated if
+ * a replacement is longer than the flag it replaces. Returns 1 if found */
+int patch_fstab(void **buf, uint32_t *size, int families, bool patch);
 
 #endif
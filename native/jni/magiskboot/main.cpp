@@ -7,6 +7,8 @@
 #include <mincrypt/sha.h>
 
 #include "magiskboot.h"
+#include "parallel.h"
+#include "profile.h"
 #include "logging.h"
 #include "utils.h"
 #include "flags.h"
@@ -17,23 +19,55 @@
 
 static void usage(char *arg0) {
 	fprintf(stderr,
-		"Usage: %s <action> [args...]\n"
+		"Usage: %s [--threads=N] <action> [args...]\n"
+		"\n"
+		"Global options:\n"
+		"  --threads=N\n"
+		"    Use at most N threads for compression (default: one per CPU)\n"
+		"  --xz-block=SIZE\n"
+		"    Block size of the multi-threaded xz encoder, suffix K or M allowed\n"
+		"    (default: 8M)\n"
+		"  --profile[=FILE]\n"
+		"    Write wall time, CPU time, bytes in/out and peak RSS of every phase\n"
+		"    (parse, find_dtb, decompress, cpio_load, patch, backup, dump, compress,\n"
+		"    hash) as JSON lines to FILE, or stderr, when done\n"
 		"\n"
 		"Supported actions:\n"
 		"  --unpack <bootimg>\n"
 		"    Unpack <bootimg> to kernel, ramdisk.cpio, and if available, second, dtb,\n"
 		"    and extra into the current directory. Return values:\n"
 		"    0:valid    1:error    2:chromeos    3:ELF32    4:ELF64\n"
+		"    <bootimg> can also be an Android sparse image\n"
 		"\n"
-		"  --repack <origbootimg> [outbootimg]\n"
+		"  --repack [--max-size SIZE] <origbootimg> [outbootimg]\n"
 		"    Repack kernel, ramdisk.cpio[.ext], second, dtb... from current directory\n"
 		"    to [outbootimg], or new-boot.img if not specified.\n"
 		"    It will compress ramdisk.cpio with the same method used in <origbootimg>,\n"
 		"    or attempt to find ramdisk.cpio.[ext], and repack directly with the\n"
 		"    compressed ramdisk file\n"
+		"    A kernel or ramdisk unchanged since --unpack is not compressed again,\n"
+		"    the original compressed data is copied instead\n"
+		"    With --max-size, if the image is larger than SIZE (suffix K or M\n"
+		"    allowed), stronger settings of the same compression methods are tried,\n"
+		"    and those that fit and decode the fastest are used\n"
+		"    If <origbootimg> is an Android sparse image, so is [outbootimg]\n"
+		"\n"
+		"  --patch <inbootimg> <outbootimg> [commands...]\n"
+		"    Unpack <inbootimg>, do cpio commands (see --cpio) to its ramdisk, and\n"
+		"    repack to <outbootimg>, all in memory without any temporary files\n"
+		"\n"
+		"  --batch <manifest>\n"
+		"    Do --patch for every line of <manifest>, with jobs running concurrently\n"
+		"    Each line is: <inbootimg> <outbootimg> [command1; command2; ...]\n"
+		"    An error in an image or its commands only fails that job\n"
+		"    Status of every job is printed to STDOUT as one JSON object per line\n"
+		"    Return value is 0 if all jobs succeeded, 1 otherwise\n"
 		"\n"
-		"  --hexpatch <file> <hexpattern1> <hexpattern2>\n"
+		"  --hexpatch <file> <hexpattern1> <hexpattern2> [<hexpattern1> <hexpattern2>...]\n"
+		"  --hexpatch <file> -f <patchlist>\n"
 		"    Search <hexpattern1> in <file>, and replace with <hexpattern2>\n"
+		"    All pairs are applied in a single pass, <patchlist> has one pair per line\n"
+		"    '?' matches any nibble in <hexpattern1>, and keeps it in <hexpattern2>\n"
 		"\n"
 		"  --cpio <incpio> [commands...]\n"
 		"    Do cpio commands to <incpio> (modifications are done directly)\n"
@@ -49,6 +83,10 @@ static void usage(char *arg0) {
 		"        Move SOURCE to DEST\n"
 		"      add MODE ENTRY INFILE\n"
 		"        Add INFILE as ENTRY in permissions MODE; replaces ENTRY if exists\n"
+		"      addtree MODE_POLICY DIR PREFIX\n"
+		"        Add everything in DIR under PREFIX; replaces entries if exist\n"
+		"        MODE_POLICY is either 'keep' to use the permissions on disk, or\n"
+		"        the MODE of all files (directories also get search permission)\n"
 		"      extract [ENTRY OUT]\n"
 		"        Extract ENTRY to OUT, or extract all entries to current directory\n"
 		"      test\n"
@@ -72,6 +110,7 @@ static void usage(char *arg0) {
 		"\n"
 		"  --dtb-<cmd> <dtb>\n"
 		"    Do dtb related cmds to <dtb> (modifications are done directly)\n"
+		"    <dtb> can be concatenated dtbs or an Android dtbo / dt table image\n"
 		"    Supported commands:\n"
 		"      dump\n"
 		"        Dump all contents from dtb for debugging\n"
@@ -85,6 +124,7 @@ static void usage(char *arg0) {
 		"  --compress[=method] <infile> [outfile]\n"
 		"    Compress <infile> with [method] (default: gzip), optionally to [outfile]\n"
 		"    <infile>/[outfile] can be '-' to be STDIN/STDOUT\n"
+		"    STDIN is compressed as it is read, in a single stream of bounded memory\n"
 		"    Supported methods: "
 	, arg0);
 	for (int i = 0; SUP_LIST[i]; ++i)
@@ -94,6 +134,7 @@ static void usage(char *arg0) {
 		"  --decompress <infile> [outfile]\n"
 		"    Detect method and decompress <infile>, optionally to [outfile]\n"
 		"    <infile>/[outfile] can be '-' to be STDIN/STDOUT\n"
+		"    STDIN is decompressed as it is read, in bounded memory\n"
 		"    Supported methods: ");
 	for (int i = 0; SUP_LIST[i]; ++i)
 		fprintf(stderr, "%s ", SUP_LIST[i]);
@@ -109,11 +150,43 @@ static void usage(char *arg0) {
 	exit(1);
 }
 
+// Size with an optional K or M suffix
+static size_t parse_size(const char *s) {
+	char *unit;
+	size_t size = strtoul(s, &unit, 10);
+	if (*unit == 'K' || *unit == 'k')
+		size <<= 10;
+	else if (*unit == 'M' || *unit == 'm')
+		size <<= 20;
+	return size;
+}
+
 int main(int argc, char *argv[]) {
 	cmdline_logging();
 	fprintf(stderr, "MagiskBoot v" xstr(MAGISK_VERSION) "(" xstr(MAGISK_VER_CODE) ") (by topjohnwu) - Boot Image Modification Tool\n");
 
 	umask(0);
+
+	// Global options
+	while (argc > 1) {
+		if (strncmp(argv[1], "--threads=", 10) == 0) {
+			nr_threads = atoi(argv[1] + 10);
+		} else if (strcmp(argv[1], "--profile") == 0) {
+			profile_start(nullptr);
+		} else if (strncmp(argv[1], "--profile=", 10) == 0) {
+			profile_start(argv[1] + 10);
+		} else if (strncmp(argv[1], "--xz-block=", 11) == 0) {
+			xz_block_size = parse_size(argv[1] + 11);
+			if (xz_block_size < (1 << 20))
+				xz_block_size = 1 << 20;
+		} else {
+			break;
+		}
+		argv[1] = argv[0];
+		--argc;
+		++argv;
+	}
+
 	if (argc > 1 && strcmp(argv[1], "--cleanup") == 0) {
 		fprintf(stderr, "Cleaning up...\n");
 		char name[PATH_MAX];
@@ -124,6 +197,7 @@ int main(int argc, char *argv[]) {
 		unlink(DTB_FILE);
 		unlink(EXTRA_FILE);
 		unlink(RECV_DTBO_FILE);
+		unlink(ORIGIN_FILE);
 		for (int i = 0; SUP_EXT_LIST[i]; ++i) {
 			sprintf(name, "%s.%s", RAMDISK_FILE, SUP_EXT_LIST[i]);
 			unlink(name);
@@ -133,6 +207,7 @@ int main(int argc, char *argv[]) {
 		void *buf;
 		size_t size;
 		mmap_ro(argv[2], &buf, &size);
+		prof_scope prof(PROF_HASH, size);
 		SHA_hash(buf, size, sha1);
 		for (int i = 0; i < SHA_DIGEST_SIZE; ++i)
 			printf("%02x", sha1[i]);
@@ -140,8 +215,18 @@ int main(int argc, char *argv[]) {
 		munmap(buf, size);
 	} else if (argc > 2 && strcmp(argv[1], "--unpack") == 0) {
 		return unpack(argv[2]);
+	} else if (argc > 4 && strcmp(argv[1], "--repack") == 0 && strcmp(argv[2], "--max-size") == 0) {
+		size_t max_size = parse_size(argv[3]);
+		if (max_size == 0) usage(argv[0]);
+		repack(argv[4], argc > 5 ? argv[5] : NEW_BOOT, max_size);
 	} else if (argc > 2 && strcmp(argv[1], "--repack") == 0) {
 		repack(argv[2], argc > 3 ? argv[3] : NEW_BOOT);
+	} else if (argc > 3 && strcmp(argv[1], "--patch") == 0) {
+		int ret = patch(argv[2], argv[3], argc - 4, argv + 4);
+		if (ret < 0) usage(argv[0]);
+		return ret;
+	} else if (argc > 2 && strcmp(argv[1], "--batch") == 0) {
+		return batch(argv[2]) ? 1 : 0;
 	} else if (argc > 2 && strcmp(argv[1], "--decompress") == 0) {
 		decompress(argv[2], argc > 3 ? argv[3] : NULL);
 	} else if (argc > 2 && strncmp(argv[1], "--compress", 10) == 0) {
@@ -151,9 +236,12 @@ int main(int argc, char *argv[]) {
 		else method++;
 		compress(method, argv[2], argc > 3 ? argv[3] : NULL);
 	} else if (argc > 4 && strcmp(argv[1], "--hexpatch") == 0) {
-		hexpatch(argv[2], argv[3], argv[4]);
+		if (hexpatch(argv[2], argc - 3, argv + 3))
+			usage(argv[0]);
 	} else if (argc > 2 && strcmp(argv[1], "--cpio") == 0) {
-		if (cpio_commands(argc - 2, argv + 2)) usage(argv[0]);
+		int ret = cpio_commands(argc - 2, argv + 2);
+		if (ret < 0) usage(argv[0]);
+		return ret;
 	} else if (argc > 2 && strncmp(argv[1], "--dtb", 5) == 0) {
 		char *cmd = argv[1] + 5;
 		if (*cmd == '\0') usage(argv[0]);
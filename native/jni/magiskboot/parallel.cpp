@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "logging.h"
+
+int nr_threads = 0;
+__thread int thread_budget = 0;
+__thread job_error *soft_errors = nullptr;
+
+int get_threads() {
+	if (thread_budget > 0)
+		return thread_budget;
+	if (nr_threads > 0)
+		return nr_threads;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+void soft_error(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	job_error *err = soft_errors;
+	if (err && !__atomic_exchange_n(&err->set, true, __ATOMIC_ACQ_REL)) {
+		va_list copy;
+		va_copy(copy, ap);
+		vsnprintf(err->msg, sizeof(err->msg), fmt, copy);
+		va_end(copy);
+	}
+	log_cb.e(fmt, ap);
+	va_end(ap);
+	if (err == nullptr)
+		log_cb.ex(1);
+}
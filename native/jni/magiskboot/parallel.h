@@ -0,0 +1,77 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "profile.h"
+
+// Maximum number of worker threads, 0 means one per online CPU
+extern int nr_threads;
+// Takes the place of nr_threads on this thread and the workers it starts
+extern __thread int thread_budget;
+int get_threads();
+
+// First error of a job whose errors are soft, see soft_error()
+struct job_error {
+	bool set;
+	char msg[256];
+};
+// The job with soft errors this thread and the workers it starts run, if any
+extern __thread job_error *soft_errors;
+
+/* Report an error in the input, such as a corrupted image. Like LOGE it ends
+ * the process, unless errors are soft on this thread: then the message is
+ * kept in the job, and the caller has to return the error */
+void soft_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+template <class F>
+struct parallel_job {
+	F *fn;
+	size_t total;
+	size_t next;
+	int budget;
+	job_error *err;
+	prof_scope *scope;
+	unsigned phases;
+};
+
+template <class F>
+static void parallel_run(parallel_job<F> *job) {
+	for (size_t i; (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->total;)
+		(*job->fn)(i);
+}
+
+template <class F>
+static void *parallel_worker(void *arg) {
+	auto job = static_cast<parallel_job<F> *>(arg);
+	thread_budget = job->budget;
+	soft_errors = job->err;
+	prof_current = job->scope;
+	prof_phases = job->phases;
+	parallel_run(job);
+	// The whole thread worked for the profiled scope that started it
+	if (job->scope)
+		job->scope->add_cpu(thread_cpu_ns());
+	return nullptr;
+}
+
+/* Call fn(i) for every i in [0, n) on up to get_threads() threads.
+ * Returns after all calls are done; the calling thread also takes jobs. */
+template <class F>
+void parallel_for(size_t n, F fn) {
+	parallel_job<F> job { &fn, n, 0, thread_budget, soft_errors, prof_current, prof_phases };
+	size_t threads = get_threads();
+	if (threads > n)
+		threads = n;
+	pthread_t *tids = new pthread_t[threads];
+	for (size_t i = 1; i < threads; ++i)
+		xpthread_create(&tids[i], nullptr, parallel_worker<F>, &job);
+	parallel_run(&job);
+	for (size_t i = 1; i < threads; ++i)
+		pthread_join(tids[i], nullptr);
+	delete[] tids;
+}
+
+#endif
@@ -4,71 +4,113 @@
 #include "magiskboot.h"
 #include "utils.h"
 
-static int check_verity_pattern(const char *s) {
-	int skip = 0;
-	if (s[0] == ',') ++skip;
-	if (strncmp(s + skip, "verify", 6) == 0)
-		skip += 6;
-	else if (strncmp(s + skip, "avb", 3) == 0)
-		skip += 3;
-	else
-		return -1;
+struct fstab_flag {
+	const char *name;
+	int family;
+	// nullptr removes the flag together with its value
+	const char *replace;
+};
 
-	if (s[skip] == '=') {
-		while (s[skip] != '\0' && s[skip] != ' ' && s[skip] != '\n' && s[skip] != ',') ++skip;
-	}
-	return skip;
+static const fstab_flag flag_list[] = {
+	{ "verify", FSTAB_VERITY, nullptr },
+	{ "verifyatboot", FSTAB_VERITY, nullptr },
+	{ "avb", FSTAB_VERITY, nullptr },
+	{ "avb_keys", FSTAB_VERITY, nullptr },
+	{ "forceencrypt", FSTAB_ENCRYPT, "encryptable" },
+	{ "forcefdeorfbe", FSTAB_ENCRYPT, "encryptable" },
+};
+
+static bool is_sep(char c) {
+	return c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\0';
 }
 
-static int check_encryption_pattern(const char *s) {
-	const char *encrypt_list[] = { "forceencrypt", "forcefdeorfbe", NULL };
-	for (int i = 0 ; encrypt_list[i]; ++i) {
-		int len = strlen(encrypt_list[i]);
-		if (strncmp(s, encrypt_list[i], len) == 0)
-			return len;
+/* Match a whole flag at s, optionally followed by =value.
+ * len is set to the length of the flag including its value */
+static const fstab_flag *match_flag(const char *s, size_t left, int families, size_t &len) {
+	for (auto &f : flag_list) {
+		if ((f.family & families) == 0)
+			continue;
+		size_t n = strlen(f.name);
+		if (n > left || memcmp(s, f.name, n) || (n < left && !is_sep(s[n]) && s[n] != '='))
+			continue;
+		if (n < left && s[n] == '=') {
+			while (n < left && !is_sep(s[n]))
+				++n;
+		}
+		len = n;
+		return &f;
 	}
-	return -1;
+	return nullptr;
 }
 
-int patch_verity(void **buf, uint32_t *size, int patch) {
-	int skip, src_size = *size, found = 0;
-	char *src = (char *) *buf, *patched = patch ? (char *) xcalloc(src_size, 1) : nullptr;
-	for (int read = 0, write = 0; read < src_size; ++read, ++write) {
-		if ((skip = check_verity_pattern(src + read)) > 0) {
-			if (patch) {
-				fprintf(stderr, "Remove pattern [%.*s]\n", skip, src + read);
-				*size -= skip;
-			} else {
-				fprintf(stderr, "Found pattern [%.*s]\n", skip, src + read);
-			}
-			read += skip;
-			found = 1;
-		}
-		if (patch)
-			patched[write] = src[read];
+int patch_fstab(void **buf, uint32_t *size, int families, bool patch) {
+	char *src = (char *) *buf;
+	size_t src_size = *size;
+
+	// Only a replacement longer than its flag needs a new buffer
+	size_t grow = 0, shortest = src_size + 1;
+	for (auto &f : flag_list) {
+		if ((f.family & families) == 0)
+			continue;
+		size_t n = strlen(f.name);
+		if (n < shortest)
+			shortest = n;
+		if (f.replace && strlen(f.replace) > n + grow)
+			grow = strlen(f.replace) - n;
 	}
-	if (patch) {
-		free(*buf);
-		*buf = patched;
+	char *out = src;
+	if (patch && grow)
+		out = (char *) xmalloc(src_size + (src_size / shortest + 1) * grow);
+
+	// Flags are only looked for at the start of a token
+	bool boundary = true;
+	int found = 0;
+	size_t read = 0, write = 0;
+	while (read < src_size) {
+		const fstab_flag *f;
+		size_t len;
+		if (!boundary || (f = match_flag(src + read, src_size - read, families, len)) == nullptr) {
+			boundary = is_sep(src[read]);
+			if (patch)
+				out[write] = src[read];
+			++read;
+			++write;
+			continue;
+		}
+		found = 1;
+		if (!patch) {
+			fprintf(stderr, "Found pattern [%.*s]\n", (int) len, src + read);
+		} else if (f->replace) {
+			size_t name_len = strlen(f->name), rep_len = strlen(f->replace);
+			fprintf(stderr, "Replace pattern [%s] with [%s]\n", f->name, f->replace);
+			memcpy(out + write, f->replace, rep_len);
+			// The value stays
+			memmove(out + write + rep_len, src + read + name_len, len - name_len);
+			write += rep_len + len - name_len;
+			read += len;
+			continue;
+		} else {
+			fprintf(stderr, "Remove pattern [%.*s]\n", (int) len, src + read);
+			// Take one separating comma along, preferably the one before
+			if (write > 0 && out[write - 1] == ',')
+				--write;
+			else if (read + len < src_size && src[read + len] == ',')
+				++len;
+			read += len;
+			// Whatever follows now starts a token
+			boundary = true;
+			continue;
+		}
+		read += len;
+		write += len;
 	}
-	return found;
-}
 
-void patch_encryption(void **buf, uint32_t *size) {
-	int skip, src_size = *size;
-	char *src = (char *) *buf, *patched = (char *) xcalloc(src_size, 1);
-	for (int read = 0, write = 0; read < src_size; ++read, ++write) {
-		if ((skip = check_encryption_pattern(src + read)) > 0) {
-			fprintf(stderr, "Replace pattern [%.*s] with [encryptable]\n", skip, src + read);
-			memcpy(patched + read, "encryptable", 11);
-			read += skip;
-			write += 11;
-			*size -= (skip - 11);
+	if (patch) {
+		*size = write;
+		if (out != src) {
+			free(*buf);
+			*buf = out;
 		}
-		patched[write] = src[read];
 	}
-	free(*buf);
-	*buf = patched;
+	return found;
 }
-
-
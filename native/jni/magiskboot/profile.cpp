@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "profile.h"
+#include "utils.h"
+#include "logging.h"
+
+bool profiling = false;
+
+static const char *phase_names[PROF_NUM] = {
+	"parse", "find_dtb", "decompress", "cpio_load", "patch", "backup", "dump", "compress", "hash"
+};
+
+struct phase_stat {
+	unsigned calls;
+	// Runs of the phase going on, and since when one has been
+	int active;
+	uint64_t since;
+	uint64_t wall;
+	uint64_t cpu;
+	bool partial;
+	uint64_t in;
+	uint64_t out;
+	long peak_kb;
+};
+
+static phase_stat stats[PROF_NUM];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static int running;
+static FILE *prof_out;
+__thread prof_scope *prof_current = nullptr;
+__thread unsigned prof_phases = 0;
+
+static uint64_t now_ns(clockid_t clock) {
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t thread_cpu_ns() {
+	return now_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void prof_untracked() {
+	if (prof_current)
+		__atomic_store_n(&prof_current->partial, true, __ATOMIC_RELAXED);
+}
+
+// Writing 5 to clear_refs resets VmHWM, on older kernels it stays the peak of the process
+void reset_peak_rss() {
+	int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		write(fd, "5", 1);
+		close(fd);
+	}
+}
+
+long peak_rss_kb() {
+	long kb = 0;
+	char line[128];
+	FILE *fp = fopen("/proc/self/status", "re");
+	if (fp == nullptr)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+			break;
+	}
+	fclose(fp);
+	return kb;
+}
+
+/* Phases overlap when nested or run on different threads, so the peak is only
+ * reset when nothing else is running: it covers everything that ran alongside.
+ * Wall time is the time any run of the phase was going on, concurrent runs
+ * are not added up */
+void prof_scope::begin() {
+	if (prof_phases & (1u << phase))
+		return;
+	active = true;
+	prof_phases |= 1u << phase;
+	prev = prof_current;
+	prof_current = this;
+	pthread_mutex_lock(&stats_lock);
+	if (running++ == 0)
+		reset_peak_rss();
+	phase_stat &s = stats[phase];
+	if (s.active++ == 0)
+		s.since = now_ns(CLOCK_MONOTONIC);
+	pthread_mutex_unlock(&stats_lock);
+	cpu = thread_cpu_ns();
+}
+
+void prof_scope::end() {
+	uint64_t used = thread_cpu_ns() - cpu + __atomic_load_n(&workers, __ATOMIC_RELAXED);
+	long peak = peak_rss_kb();
+	prof_phases &= ~(1u << phase);
+	prof_current = prev;
+	// The thread itself is counted by the enclosing scope, the workers are not
+	if (prev) {
+		prev->add_cpu(workers);
+		if (partial)
+			__atomic_store_n(&prev->partial, true, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_lock(&stats_lock);
+	--running;
+	phase_stat &s = stats[phase];
+	++s.calls;
+	if (--s.active == 0)
+		s.wall += now_ns(CLOCK_MONOTONIC) - s.since;
+	s.cpu += used;
+	s.partial |= partial;
+	s.in += in;
+	s.out += out;
+	if (peak > s.peak_kb)
+		s.peak_kb = peak;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+// Not locked, exit() may come from a thread holding the lock
+static void profile_dump() {
+	for (int i = 0; i < PROF_NUM; ++i) {
+		phase_stat &s = stats[i];
+		if (s.calls == 0)
+			continue;
+		fprintf(prof_out, "{\"phase\":\"%s\",\"calls\":%u,\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"cpu_partial\":%s,"
+				"\"bytes_in\":%llu,\"bytes_out\":%llu,\"peak_rss_kb\":%ld}\n",
+				phase_names[i], s.calls, s.wall / 1000000.0, s.cpu / 1000000.0, s.partial ? "true" : "false",
+				(unsigned long long) s.in, (unsigned long long) s.out, s.peak_kb);
+	}
+	fflush(prof_out);
+}
+
+void profile_start(const char *file) {
+	prof_out = file ? xfopen(file, "we") : stderr;
+	if (prof_out == nullptr)
+		LOGE("Cannot write profile to [%s]\n", file);
+	profiling = true;
+	atexit(profile_dump);
+}
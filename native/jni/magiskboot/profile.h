@@ -0,0 +1,78 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum prof_phase {
+	PROF_PARSE,
+	PROF_FIND_DTB,
+	PROF_DECOMPRESS,
+	PROF_CPIO_LOAD,
+	PROF_PATCH,
+	PROF_BACKUP,
+	PROF_DUMP,
+	PROF_COMPRESS,
+	PROF_HASH,
+	PROF_NUM
+};
+
+// Set by profile_start, before any work is done
+extern bool profiling;
+
+/* Record all phases from now on. They are written as JSON lines to file,
+ * or stderr if file is nullptr, when the process exits */
+void profile_start(const char *file);
+
+// Reset the peak RSS of the process, and read it in KB (0 if unknown)
+void reset_peak_rss();
+long peak_rss_kb();
+
+// CPU time used by the calling thread so far, in ns
+uint64_t thread_cpu_ns();
+
+class prof_scope;
+// Innermost scope measured on this thread, or the one that started it
+extern __thread prof_scope *prof_current;
+// Bit of every phase being measured on this thread, or the one that started it
+extern __thread unsigned prof_phases;
+
+/* Threads the current scope does not know about are working for it, such as
+ * those of the xz encoder in liblzma: its CPU time is reported as partial */
+void prof_untracked();
+
+/* Count the enclosing scope as a run of phase. Nothing is measured unless
+ * profiling, and a phase nested in itself, also in parallel_for workers,
+ * counts once. Its CPU time is that of the thread plus the workers it starts */
+class prof_scope {
+public:
+	prof_scope(prof_phase phase, size_t in = 0) : phase(phase), in(in) {
+		if (profiling)
+			begin();
+	}
+	~prof_scope() {
+		if (active)
+			end();
+	}
+	void set_in(size_t n) { in = n; }
+	void set_out(size_t n) { out = n; }
+	// CPU time of a parallel_for worker started in the scope
+	void add_cpu(uint64_t ns) { __atomic_fetch_add(&workers, ns, __ATOMIC_RELAXED); }
+
+private:
+	prof_phase phase;
+	bool active = false;
+	bool partial = false;
+	size_t in;
+	size_t out = 0;
+	uint64_t cpu;
+	uint64_t workers = 0;
+	prof_scope *prev;
+
+	friend void prof_untracked();
+
+	void begin();
+	void end();
+};
+
+#endif
@@ -5,43 +5,34 @@
 #include "magiskboot.h"
 #include "array.h"
 #include "cpio.h"
+#include "profile.h"
 #include "utils.h"
 
 class magisk_cpio : public cpio {
 public:
-	magisk_cpio(const char *filename) : cpio(filename) {}
 	void patch(bool keepverity, bool keepforceencrypt);
 	int test();
 	char * sha1();
 	void restore();
-	void backup(Array<cpio_entry*> &bak, const char *orig, const char *sha1);
+	void backup(Array<cpio_entry*> &bak, magisk_cpio &o, const char *sha1);
 };
 
 void magisk_cpio::patch(bool keepverity, bool keepforceencrypt) {
+	prof_scope prof(PROF_PATCH);
 	fprintf(stderr, "Patch with flag KEEPVERITY=[%s] KEEPFORCEENCRYPT=[%s]\n",
 			keepverity ? "true" : "false", keepforceencrypt ? "true" : "false");
+	int families = (keepverity ? 0 : FSTAB_VERITY) | (keepforceencrypt ? 0 : FSTAB_ENCRYPT);
 	for (auto &e : arr) {
-		if (!e)
-			continue;
-		bool fstab = (!keepverity || !keepforceencrypt) &&
+		bool fstab = families &&
 				!e->filename.starts_with(".backup") &&
 					 e->filename.contains("fstab") && S_ISREG(e->mode);
-		if (!keepverity) {
-			if (fstab) {
-				patch_verity(&e->data, &e->filesize, 1);
-			} else if (e->filename == "verity_key") {
-				fprintf(stderr, "Remove [verity_key]\n");
-				delete e;
-				e = nullptr;
-				continue;
-			}
-		}
-		if (!keepforceencrypt) {
-			if (fstab) {
-				patch_encryption(&e->data, &e->filesize);
-			}
+		if (fstab) {
+			e->detach();
+			patch_fstab(&e->data, &e->filesize, families, true);
 		}
 	}
+	if (!keepverity)
+		rm("verity_key");
 }
 
 
@@ -55,11 +46,11 @@ int magisk_cpio::test() {
 									  "overlay/init.magisk.rc" };
 
 	for (auto file : UNSUPPORT_LIST)
-		if (find(file) >= 0)
+		if (find(file))
 			return UNSUPPORT_PATCH;
 
 	for (auto file : MAGISK_LIST)
-		if (find(file) >= 0)
+		if (find(file))
 			return MAGISK_PATCH;
 
 	return STOCK_BOOT;
@@ -80,25 +71,27 @@ char *magisk_cpio::sha1() {
 				}
 			}
 		} else if (e->filename == ".backup/.sha1") {
-			return (char *) e->data;
+			return strndup((char *) e->data, e->filesize);
 		}
 	}
 	return nullptr;
 }
 
 void magisk_cpio::restore() {
-	for (auto &e : arr) {
-		if (!e) continue;
-		if (e->filename.starts_with(".backup")) {
-			if (e->filename[7] == '\0') continue;
-			if (e->filename[8] == '.') {
-				if (strcmp(&e->filename[8], ".rmlist") == 0) {
-					for (int pos = 0; pos < e->filesize; pos += strlen((char *) e->data + pos) + 1)
-						rm((char *) e->data + pos, false);
-				}
-			} else {
-				mv(e->filename, e->filename + 8);
+	size_t begin, end;
+	subtree(".backup", begin, end);
+	// rm and mv below shuffle arr around, work on a copy of the range
+	Array<cpio_entry *> bak;
+	for (size_t i = begin; i < end; ++i)
+		bak.push_back(arr[i]);
+	for (auto &e : bak) {
+		if (e->filename[8] == '.') {
+			if (strcmp(&e->filename[8], ".rmlist") == 0) {
+				for (int pos = 0; pos < e->filesize; pos += strlen((char *) e->data + pos) + 1)
+					rm((char *) e->data + pos, false);
 			}
+		} else {
+			mv(e->filename, e->filename + 8);
 		}
 	}
 
@@ -110,7 +103,9 @@ void magisk_cpio::restore() {
 	rm("magisk", true);
 }
 
-void magisk_cpio::backup(Array<cpio_entry*> &bak, const char *orig, const char *sha1) {
+// o is the original ramdisk, entries moved to the backup are taken out of it
+void magisk_cpio::backup(Array<cpio_entry*> &bak, magisk_cpio &o, const char *sha1) {
+	prof_scope prof(PROF_BACKUP);
 	cpio_entry *m, *n, *rem, *cksm;
 	char buf[PATH_MAX];
 
@@ -133,16 +128,11 @@ void magisk_cpio::backup(Array<cpio_entry*> &bak, const char *orig, const char *
 		bak.push_back(cksm);
 	}
 
-	magisk_cpio o(orig);
-
 	// Remove possible backups in original ramdisk
 	o.rm(".backup", true);
 	rm(".backup", true);
 
-	// Sort both CPIOs before comparing
-	o.sort();
-	sort();
-
+	// Both CPIOs are sorted by name
 	// Start comparing
 	size_t i = 0, j = 0;
 	while(i != o.arr.size() || j != arr.size()) {
@@ -197,30 +187,32 @@ void magisk_cpio::backup(Array<cpio_entry*> &bak, const char *orig, const char *
 }
 
 
-int cpio_commands(int argc, char *argv[]) {
-	char *incpio = argv[0];
-	++argv;
-	--argc;
-
-	magisk_cpio cpio(incpio);
-
+/* Run all commands on cpio. Returns true if the archive should be saved,
+ * otherwise a command has finished the job, with its exit value in ret.
+ * ret is -1 if a command is not known or fails, which it only does before
+ * changing the archive */
+static bool run_commands(magisk_cpio &cpio, int argc, char *argv[], int &ret) {
 	int cmdc;
-	char *cmdv[6];
+	char *cmdv[6], *save;
 
-	while (argc) {
+	for (; argc; --argc, ++argv) {
 		// Clean up
 		cmdc = 0;
 		memset(cmdv, NULL, sizeof(cmdv));
 
-		// Split the commands
-		for (char *tok = strtok(argv[0], " "); tok; tok = strtok(nullptr, " "))
+		// Split the commands, none of them takes that many arguments
+		for (char *tok = strtok_r(argv[0], " ", &save); tok; tok = strtok_r(nullptr, " ", &save)) {
+			if (cmdc == 6)
+				goto fail;
 			cmdv[cmdc++] = tok;
+		}
 
 		if (cmdc == 0)
 			continue;
 
 		if (strcmp(cmdv[0], "test") == 0) {
-			exit(cpio.test());
+			ret = cpio.test();
+			return false;
 		} else if (strcmp(cmdv[0], "restore") == 0) {
 			cpio.restore();
 		} else if (strcmp(cmdv[0], "sha1") == 0) {
@@ -228,16 +220,24 @@ int cpio_commands(int argc, char *argv[]) {
 			if (sha1)
 				printf("%s\n", sha1);
 			free(sha1);
-			return 0;
+			ret = 0;
+			return false;
 		} else if (cmdc >= 2 && strcmp(cmdv[0], "backup") == 0) {
+			magisk_cpio orig;
+			if (!orig.load(cmdv[1]))
+				goto fail;
 			Array<cpio_entry*> bak;
-			cpio.backup(bak, cmdv[1], cmdv[2]);
+			cpio.backup(bak, orig, cmdv[2]);
 			cpio.insert(bak);
 		} else if (cmdc >= 4 && strcmp(cmdv[0], "magisk") == 0) {
+			// Nothing is changed unless the original loads
+			magisk_cpio orig;
+			if (!orig.load(cmdv[1]))
+				goto fail;
 			cpio.patch(strcmp(cmdv[2], "true") == 0, strcmp(cmdv[3], "true") == 0);
 
 			Array<cpio_entry*> bak;
-			cpio.backup(bak, cmdv[1], cmdv[4]);
+			cpio.backup(bak, orig, cmdv[4]);
 
 			auto e = new cpio_entry();
 			e->filename = ".backup/.magisk";
@@ -257,25 +257,66 @@ int cpio_commands(int argc, char *argv[]) {
 			cpio.patch(strcmp(cmdv[1], "true") == 0, strcmp(cmdv[2], "true") == 0);
 		} else if (strcmp(cmdv[0], "extract") == 0) {
 			if (cmdc == 3) {
-				return cpio.extract(cmdv[1], cmdv[2]);
+				ret = cpio.extract(cmdv[1], cmdv[2]) ? 0 : 1;
 			} else {
 				cpio.extract();
-				return 0;
+				ret = 0;
 			}
+			return false;
 		} else if (cmdc == 3 && strcmp(cmdv[0], "mkdir") == 0) {
 			cpio.makedir(strtoul(cmdv[1], NULL, 8), cmdv[2]);
 		} else if (cmdc == 3 && strcmp(cmdv[0], "ln") == 0) {
 			cpio.ln(cmdv[1], cmdv[2]);
 		} else if (cmdc == 4 && strcmp(cmdv[0], "add") == 0) {
-			cpio.add(strtoul(cmdv[1], NULL, 8), cmdv[2], cmdv[3]);
+			if (!cpio.add(strtoul(cmdv[1], NULL, 8), cmdv[2], cmdv[3]))
+				goto fail;
+		} else if (cmdc == 4 && strcmp(cmdv[0], "addtree") == 0) {
+			int mode = strcmp(cmdv[1], "keep") == 0 ? -1 : strtoul(cmdv[1], NULL, 8);
+			if (!cpio.addtree(mode, cmdv[2], cmdv[3]))
+				goto fail;
 		} else {
-			return 1;
+			goto fail;
 		}
-
-		--argc;
-		++argv;
 	}
 
-	cpio.dump(incpio);
-	return 0;
-}
\ No newline at end of file
+	ret = 0;
+	return true;
+
+fail:
+	ret = -1;
+	return false;
+}
+
+int cpio_commands(int argc, char *argv[]) {
+	char *incpio = argv[0];
+	magisk_cpio cpio;
+	cpio.load(incpio);
+	int ret;
+	if (run_commands(cpio, argc - 1, argv + 1, ret))
+		cpio.dump(incpio);
+	return ret;
+}
+
+cpio *load_ramdisk(const void *buf, size_t size) {
+	auto rd = new magisk_cpio();
+	if (rd->load(buf, size))
+		return rd;
+	delete rd;
+	return nullptr;
+}
+
+bool ramdisk_commands(cpio *rd, int argc, char *argv[], int &ret) {
+	return run_commands(*static_cast<magisk_cpio *>(rd), argc, argv, ret);
+}
+
+cpio *ramdisk_commands(const void *buf, size_t size, int argc, char *argv[], int &ret) {
+	cpio *rd = load_ramdisk(buf, size);
+	if (rd == nullptr) {
+		ret = -1;
+		return nullptr;
+	}
+	if (ramdisk_commands(rd, argc, argv, ret))
+		return rd;
+	delete rd;
+	return nullptr;
+}
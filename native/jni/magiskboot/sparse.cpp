@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootimg.h"
+#include "magiskboot.h"
+#include "array.h"
+#include "logging.h"
+#include "parallel.h"
+#include "utils.h"
+
+// Skipped and filled areas are written in pieces that fit in a size_t
+#define MAX_PIECE  (1U << 30)
+
+static size_t skip_out(out_stream &os, uint64_t len) {
+	for (uint64_t left = len; left;) {
+		size_t n = left < MAX_PIECE ? left : MAX_PIECE;
+		os.skip(n);
+		left -= n;
+	}
+	return len;
+}
+
+static size_t fill_out(out_stream &os, uint32_t pattern, uint64_t len) {
+	// Zeros are just as well a hole
+	if (pattern == 0)
+		return skip_out(os, len);
+	uint32_t buf[0x4000];
+	for (auto &v : buf)
+		v = pattern;
+	for (uint64_t left = len; left;) {
+		size_t n = left < sizeof(buf) ? left : sizeof(buf);
+		os.write(buf, n);
+		left -= n;
+	}
+	return len;
+}
+
+/* Headers are collected into hold, as they may be split between writes,
+ * while RAW data is passed through and everything else is skipped over.
+ * After an error with soft errors, the rest of the input is ignored */
+class sparse_decoder : public decoder_stream {
+public:
+	sparse_decoder(out_stream &os) : os(os) {}
+	size_t write(const void *buf, size_t len) override {
+		const uint8_t *in = (const uint8_t *) buf;
+		for (size_t left = len, n; left && (state != DONE || skip_in || raw_left); in += n, left -= n) {
+			if (skip_in) {
+				n = left < skip_in ? left : skip_in;
+				skip_in -= n;
+			} else if (raw_left) {
+				n = left < raw_left ? left : raw_left;
+				total += os.write(in, n);
+				raw_left -= n;
+			} else {
+				n = left < need - held ? left : need - held;
+				memcpy(hold + held, in, n);
+				held += n;
+				if (held == need)
+					next();
+			}
+		}
+		return len;
+	}
+	size_t finish() override {
+		if (!bad && (state != DONE || skip_in || raw_left)) {
+			soft_error("Truncated sparse image\n");
+			fail();
+		}
+		return bad ? CODEC_ERR : total;
+	}
+private:
+	enum { FILE_HDR, CHUNK_HDR, FILL_PATTERN, DONE } state = FILE_HDR;
+	out_stream &os;
+	sparse_hdr hdr;
+	sparse_chunk_hdr chunk;
+	uint8_t hold[sizeof(sparse_hdr)];
+	size_t need = sizeof(sparse_hdr);
+	size_t held = 0;
+	uint32_t chunks_left;
+	// Input to drop, and RAW data still to come
+	size_t skip_in = 0;
+	size_t raw_left = 0;
+	size_t total = 0;
+	bool bad = false;
+
+	void fail() {
+		bad = true;
+		state = DONE;
+		skip_in = raw_left = 0;
+	}
+
+	void next_chunk() {
+		state = chunks_left-- ? CHUNK_HDR : DONE;
+		need = sizeof(sparse_chunk_hdr);
+	}
+
+	// A header or fill pattern is complete in hold
+	void next() {
+		held = 0;
+		switch (state) {
+			case FILE_HDR:
+				memcpy(&hdr, hold, sizeof(hdr));
+				if (hdr.major_version != 1 || hdr.file_hdr_sz < sizeof(sparse_hdr) ||
+					hdr.chunk_hdr_sz < sizeof(sparse_chunk_hdr) || hdr.blk_sz == 0 || hdr.blk_sz % 4) {
+					soft_error("Unsupported sparse image\n");
+					return fail();
+				}
+				skip_in = hdr.file_hdr_sz - sizeof(sparse_hdr);
+				chunks_left = hdr.total_chunks;
+				next_chunk();
+				break;
+			case CHUNK_HDR: {
+				memcpy(&chunk, hold, sizeof(chunk));
+				if (chunk.total_sz < hdr.chunk_hdr_sz) {
+					soft_error("Corrupted sparse image\n");
+					return fail();
+				}
+				skip_in = hdr.chunk_hdr_sz - sizeof(sparse_chunk_hdr);
+				size_t data_sz = chunk.total_sz - hdr.chunk_hdr_sz;
+				uint64_t len = (uint64_t) chunk.chunk_sz * hdr.blk_sz;
+				switch (chunk.chunk_type) {
+					case CHUNK_TYPE_RAW:
+						if (data_sz != len) {
+							soft_error("Corrupted sparse image\n");
+							return fail();
+						}
+						raw_left = data_sz;
+						break;
+					case CHUNK_TYPE_FILL:
+						if (data_sz < sizeof(uint32_t)) {
+							soft_error("Corrupted sparse image\n");
+							return fail();
+						}
+						state = FILL_PATTERN;
+						need = sizeof(uint32_t);
+						return;
+					case CHUNK_TYPE_DONT_CARE:
+						total += skip_out(os, len);
+						skip_in += data_sz;
+						break;
+					case CHUNK_TYPE_CRC32:
+						skip_in += data_sz;
+						break;
+					default:
+						soft_error("Unknown sparse chunk type 0x%x\n", chunk.chunk_type);
+						return fail();
+				}
+				next_chunk();
+				break;
+			}
+			case FILL_PATTERN: {
+				uint32_t pattern;
+				memcpy(&pattern, hold, sizeof(pattern));
+				total += fill_out(os, pattern, (uint64_t) chunk.chunk_sz * hdr.blk_sz);
+				skip_in = chunk.total_sz - hdr.chunk_hdr_sz - sizeof(pattern);
+				next_chunk();
+				break;
+			}
+			case DONE:
+				break;
+		}
+	}
+};
+
+decoder_stream *get_sparse_decoder(out_stream &os) {
+	return new sparse_decoder(os);
+}
+
+struct sparse_run {
+	uint16_t type;
+	uint32_t blocks;
+	uint32_t pattern;
+	size_t off;
+};
+
+/* Blocks of a repeated 4 byte pattern become FILL chunks, zeros included, as
+ * DONT_CARE would leave whatever was in the partition. The rest is RAW */
+static size_t sparse_encode(out_stream &os, const uint8_t *buf, size_t size, uint32_t blk_sz) {
+	if (blk_sz == 0 || blk_sz % 4)
+		LOGE("Invalid sparse block size [%u]\n", blk_sz);
+	size_t blocks = (size + blk_sz - 1) / blk_sz;
+	if (blocks > UINT32_MAX)
+		LOGE("Too large for a sparse image\n");
+
+	// The last block is padded with zeros
+	size_t last = size - (blocks ? (blocks - 1) * blk_sz : 0);
+	uint8_t *pad = (uint8_t *) xcalloc(1, blk_sz);
+	if (blocks)
+		memcpy(pad, buf + (blocks - 1) * blk_sz, last);
+
+	// Chunk count goes first, so find all runs before writing anything
+	const uint32_t max_raw = (UINT32_MAX - sizeof(sparse_chunk_hdr)) / blk_sz;
+	Array<sparse_run> runs;
+	for (size_t i = 0; i < blocks; ++i) {
+		const uint8_t *b = i == blocks - 1 ? pad : buf + i * blk_sz;
+		uint32_t pattern;
+		memcpy(&pattern, b, sizeof(pattern));
+		uint16_t type = memcmp(b, b + 4, blk_sz - 4) == 0 ? CHUNK_TYPE_FILL : CHUNK_TYPE_RAW;
+		if (!runs.empty()) {
+			sparse_run &r = runs[runs.size() - 1];
+			if (r.type == type && (type == CHUNK_TYPE_RAW ? r.blocks < max_raw : r.pattern == pattern)) {
+				++r.blocks;
+				continue;
+			}
+		}
+		runs.push_back({ type, 1, pattern, i * blk_sz });
+	}
+
+	sparse_hdr hdr {};
+	hdr.magic = 0xed26ff3a;
+	hdr.major_version = 1;
+	hdr.file_hdr_sz = sizeof(sparse_hdr);
+	hdr.chunk_hdr_sz = sizeof(sparse_chunk_hdr);
+	hdr.blk_sz = blk_sz;
+	hdr.total_blks = blocks;
+	hdr.total_chunks = runs.size();
+	size_t total = os.write(&hdr, sizeof(hdr));
+
+	for (auto &r : runs) {
+		sparse_chunk_hdr chunk {};
+		chunk.chunk_type = r.type;
+		chunk.chunk_sz = r.blocks;
+		if (r.type == CHUNK_TYPE_FILL) {
+			chunk.total_sz = sizeof(chunk) + sizeof(r.pattern);
+			total += os.write(&chunk, sizeof(chunk));
+			total += os.write(&r.pattern, sizeof(r.pattern));
+			continue;
+		}
+		size_t len = (size_t) r.blocks * blk_sz;
+		chunk.total_sz = sizeof(chunk) + len;
+		total += os.write(&chunk, sizeof(chunk));
+		if (r.off + len > size) {
+			// Ends with the padded block
+			total += os.write(buf + r.off, len - blk_sz);
+			total += os.write(pad, blk_sz);
+		} else {
+			total += os.write(buf + r.off, len);
+		}
+	}
+	free(pad);
+	return total;
+}
+
+// Mode: 0 = decode; 1 = encode
+size_t sparse(int mode, out_stream &os, const void *buf, size_t size, uint32_t blk_sz) {
+	if (mode == 0) {
+		sparse_decoder dec(os);
+		dec.write(buf, size);
+		return dec.finish();
+	}
+	return sparse_encode(os, (const uint8_t *) buf, size, blk_sz);
+}
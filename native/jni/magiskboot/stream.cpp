@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "stream.h"
+#include "utils.h"
+#include "logging.h"
+
+size_t out_stream::writev(const struct iovec *iov, int iovcnt) {
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		total += write(iov[i].iov_base, iov[i].iov_len);
+	return total;
+}
+
+size_t out_stream::skip(size_t len) {
+	static const uint8_t zeros[0x10000] = {};
+	for (size_t left = len; left;) {
+		size_t n = left < sizeof(zeros) ? left : sizeof(zeros);
+		write(zeros, n);
+		left -= n;
+	}
+	return len;
+}
+
+size_t fd_stream::write(const void *buf, size_t len) {
+	return xwrite(fd, buf, len);
+}
+
+/* writev may stop short, e.g. on a signal or at the size limit of a single
+ * call, so continue from where it stopped. The rest of a partially written
+ * iovec is written on its own, as the array is not ours to modify */
+size_t fd_stream::writev(const struct iovec *iov, int iovcnt) {
+	size_t total = 0;
+	while (iovcnt) {
+		ssize_t n = ::writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			PLOGE("writev");
+		total += n;
+		for (; iovcnt && (size_t) n >= iov->iov_len; ++iov, --iovcnt)
+			n -= iov->iov_len;
+		if (n == 0)
+			continue;
+		const char *p = (const char *) iov->iov_base + n;
+		for (size_t left = iov->iov_len - n; left;) {
+			ssize_t w = ::write(fd, p, left);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				PLOGE("write");
+			p += w;
+			left -= w;
+		}
+		total += iov->iov_len - n;
+		++iov;
+		--iovcnt;
+	}
+	return total;
+}
+
+/* Seeking over the hole only works on regular files, and only past their end:
+ * data already in the file is overwritten with zeros. The file is extended
+ * right away, as there may be nothing written after the hole */
+size_t fd_stream::skip(size_t len) {
+	struct stat st;
+	off64_t pos = lseek64(fd, 0, SEEK_CUR);
+	if (pos < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return out_stream::skip(len);
+	size_t hole = len;
+	if (pos < st.st_size) {
+		size_t n = st.st_size - pos < (off64_t) len ? st.st_size - pos : len;
+		out_stream::skip(n);
+		pos += n;
+		hole -= n;
+	}
+	if (hole) {
+		if ((pos = lseek64(fd, hole, SEEK_CUR)) < 0)
+			PLOGE("lseek");
+		if (ftruncate64(fd, pos))
+			PLOGE("ftruncate");
+	}
+	return len;
+}
+
+buf_stream::~buf_stream() {
+	free(buf);
+}
+
+void buf_stream::reserve(size_t n) {
+	if (len + n <= cap)
+		return;
+	while (cap < len + n)
+		cap = cap ? cap << 1 : 0x10000;
+	buf = (uint8_t *) xrealloc(buf, cap);
+}
+
+size_t buf_stream::write(const void *in, size_t n) {
+	reserve(n);
+	memcpy(buf + len, in, n);
+	len += n;
+	return n;
+}
+
+size_t buf_stream::skip(size_t n) {
+	reserve(n);
+	memset(buf + len, 0, n);
+	len += n;
+	return n;
+}
+
+uint8_t *buf_stream::release() {
+	uint8_t *ret = buf;
+	buf = nullptr;
+	len = cap = 0;
+	return ret;
+}
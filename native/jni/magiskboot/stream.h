@@ -0,0 +1,60 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Destination of the codecs, returns the number of bytes written
+class out_stream {
+public:
+	virtual ~out_stream() = default;
+	virtual size_t write(const void *buf, size_t len) = 0;
+	virtual size_t writev(const struct iovec *iov, int iovcnt);
+	// Write len zeros, destinations that can leave a hole instead do so
+	virtual size_t skip(size_t len);
+};
+
+// Compresses everything written to it into another stream
+class encoder_stream : public out_stream {
+public:
+	// Flush the end of the compressed data, returns its total size
+	virtual size_t finish() = 0;
+};
+
+// Decompresses everything written to it into another stream
+class decoder_stream : public out_stream {
+public:
+	// Flush the rest of the decompressed data, returns its total size
+	virtual size_t finish() = 0;
+};
+
+// Writes through to a file descriptor
+class fd_stream : public out_stream {
+public:
+	explicit fd_stream(int fd) : fd(fd) {}
+	size_t write(const void *buf, size_t len) override;
+	size_t writev(const struct iovec *iov, int iovcnt) override;
+	size_t skip(size_t len) override;
+private:
+	int fd;
+};
+
+// Collects everything into a growing heap buffer
+class buf_stream : public out_stream {
+public:
+	~buf_stream();
+	size_t write(const void *buf, size_t len) override;
+	size_t skip(size_t len) override;
+	void reserve(size_t len);
+	// Hand the buffer over to the caller, who has to free() it
+	uint8_t *release();
+	uint8_t *data() const { return buf; }
+	size_t size() const { return len; }
+private:
+	uint8_t *buf = nullptr;
+	size_t len = 0;
+	size_t cap = 0;
+};
+
+#endif
@@ -226,12 +226,9 @@ static int patch_sepolicy() {
 		void *addr;
 		size_t size;
 		mmap_rw("/init", &addr, &size);
-		for (int i = 0; i < size; ++i) {
-			if (memcmp(addr + i, SPLIT_PLAT_CIL, sizeof(SPLIT_PLAT_CIL) - 1) == 0) {
-				memcpy(addr + i + sizeof(SPLIT_PLAT_CIL) - 4, "xxx", 3);
-				break;
-			}
-		}
+		void *cil = memfind(addr, size, SPLIT_PLAT_CIL, sizeof(SPLIT_PLAT_CIL) - 1);
+		if (cil)
+			memcpy(cil + sizeof(SPLIT_PLAT_CIL) - 4, "xxx", 3);
 		munmap(addr, size);
 	}
 
@@ -301,17 +298,14 @@ static void patch_socket_name(const char *path) {
 	char name[sizeof(MAIN_SOCKET)];
 	size_t size;
 	mmap_rw(path, &buf, &size);
-	for (int i = 0; i < size; ++i) {
-		if (memcmp(buf + i, MAIN_SOCKET, sizeof(MAIN_SOCKET)) == 0) {
-			gen_rand_str(name, sizeof(name));
-			memcpy(buf + i, name, sizeof(name));
-			i += sizeof(name);
-		}
-		if (memcmp(buf + i, LOG_SOCKET, sizeof(LOG_SOCKET)) == 0) {
-			gen_rand_str(name, sizeof(name));
-			memcpy(buf + i, name, sizeof(name));
-			i += sizeof(name);
-		}
+	// Both names include the terminating null
+	struct mem_needle sockets[] = {
+		{ MAIN_SOCKET, sizeof(MAIN_SOCKET) },
+		{ LOG_SOCKET, sizeof(LOG_SOCKET) },
+	};
+	for (void *p = buf; (p = memfind_any(p, buf + size - p, sockets, 2, NULL)); p += sizeof(name)) {
+		gen_rand_str(name, sizeof(name));
+		memcpy(p, name, sizeof(name));
 	}
 	munmap(buf, size);
 }
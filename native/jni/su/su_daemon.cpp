@@ -8,6 +8,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
 #include "magisk.h"
@@ -176,6 +177,9 @@ static struct su_info *get_su_info(unsigned uid) {
 			info->access.policy = DENY;
 		} else {
 			socket_send_request(fd, info);
+			// The answer may take as long as the manager took to connect
+			struct timeval timeout = { .tv_sec = 60 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 			int ret = read_int_be(fd);
 			info->access.policy = ret < 0 ? DENY : static_cast<policy_t>(ret);
 			close(fd);
@@ -238,16 +242,21 @@ void su_daemon_handler(int client, struct ucred *credential) {
 		return;
 	}
 
-	/* Fork a new process, the child process will need to setsid,
-	 * open a pseudo-terminal if needed, and will eventually run exec
-	 * The parent process will wait for the result and
-	 * send the return code back to our client
+	/* The session lasts as long as the client wants, so it is not waited on in
+	 * a worker of the daemon, but in a detached process. It forks a new process,
+	 * the child process will need to setsid, open a pseudo-terminal if needed,
+	 * and will eventually run exec. The parent process will wait for the result
+	 * and send the return code back to our client
 	 */
-	int child = xfork();
-	if (child) {
+	if (fork_dont_care()) {
 		// Decrement reference count
 		--info->ref;
+		close(client);
+		return;
+	}
 
+	int child = xfork();
+	if (child) {
 		// Wait result
 		LOGD("su: waiting child: [%d]\n", child);
 		int status, code;
@@ -260,7 +269,8 @@ void su_daemon_handler(int client, struct ucred *credential) {
 		LOGD("su: return code: [%d]\n", code);
 		write(client, &code, sizeof(code));
 		close(client);
-		return;
+		// A copy of the daemon, none of its cleanup is ours to run
+		_exit(0);
 	}
 
 	LOGD("su: fork handler\n");
@@ -10,6 +10,7 @@ LOCAL_SRC_FILES := \
 	logging.cpp \
 	xwrap.cpp \
 	CharArray.cpp \
+	search.cpp \
 	vector.c
 
 include $(BUILD_STATIC_LIBRARY)
@@ -147,6 +147,22 @@ void full_read_at(int dirfd, const char *filename, void **buf, size_t *size);
 void stream_full_read(int fd, void **buf, size_t *size);
 void write_zero(int fd, size_t size);
 
+// search.cpp
+
+struct mem_needle {
+	const void *buf;
+	size_t len;
+};
+
+// Needle from a string literal, without the terminating null
+#define MEM_NEEDLE(s) { s, sizeof(s) - 1 }
+
+/* Return the first position in buf where any of the needles matches, or NULL.
+ * If several match there, the one listed first wins and its index is stored
+ * in which if not NULL. Needles must not be empty. */
+void *memfind_any(const void *buf, size_t size, const struct mem_needle *needles, int num, int *which);
+void *memfind(const void *buf, size_t size, const void *needle, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -87,7 +87,7 @@ int fork_dont_care() {
 		waitpid(pid, nullptr, 0);
 		return pid;
 	} else if ((pid = xfork())) {
-		exit(0);
+		_exit(0);
 	}
 	return 0;
 }
@@ -0,0 +1,136 @@
+/* search.cpp - Search for byte patterns in large buffers
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/* Candidates are found by comparing the first and last byte of a needle
+ * at VEC_SIZE positions at once, and only verified with memcmp when both
+ * match. Each byte of a comparison result maps to 1 << LANE_SHIFT bits
+ * of the mask, with only the highest one of them kept. */
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define VEC_SIZE   16
+#define LANE_SHIFT 0
+typedef __m128i vec_t;
+
+static inline vec_t vec_set(uint8_t c) { return _mm_set1_epi8(c); }
+static inline vec_t vec_load(const uint8_t *p) { return _mm_loadu_si128((const __m128i *) p); }
+static inline vec_t vec_eq(vec_t a, vec_t b) { return _mm_cmpeq_epi8(a, b); }
+static inline vec_t vec_and(vec_t a, vec_t b) { return _mm_and_si128(a, b); }
+static inline uint64_t vec_mask(vec_t v) { return _mm_movemask_epi8(v); }
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+#define VEC_SIZE   16
+#define LANE_SHIFT 2
+typedef uint8x16_t vec_t;
+
+static inline vec_t vec_set(uint8_t c) { return vdupq_n_u8(c); }
+static inline vec_t vec_load(const uint8_t *p) { return vld1q_u8(p); }
+static inline vec_t vec_eq(vec_t a, vec_t b) { return vceqq_u8(a, b); }
+static inline vec_t vec_and(vec_t a, vec_t b) { return vandq_u8(a, b); }
+// There is no movemask on NEON, narrow every byte down to a nibble instead
+static inline uint64_t vec_mask(vec_t v) {
+	uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(v), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(n), 0) & 0x8888888888888888ULL;
+}
+
+#endif
+
+// Needles whose vectors are kept on the stack, more are put on the heap
+#define STACK_NEEDLES 8
+
+static inline bool match(const uint8_t *p, size_t left, const struct mem_needle &n) {
+	return n.len <= left && memcmp(p, n.buf, n.len) == 0;
+}
+
+void *memfind_any(const void *buf, size_t size, const struct mem_needle *needles, int num, int *which) {
+	auto p = (const uint8_t *) buf;
+	size_t pos = 0;
+	if (num <= 0)
+		return nullptr;
+
+#ifdef VEC_SIZE
+	{
+		vec_t stack[2 * STACK_NEEDLES];
+		vec_t *first = num <= STACK_NEEDLES ? stack : new vec_t[2 * num];
+		vec_t *last = first + num;
+		size_t max = 1;
+		for (int i = 0; i < num; ++i) {
+			auto n = (const uint8_t *) needles[i].buf;
+			first[i] = vec_set(n[0]);
+			last[i] = vec_set(n[needles[i].len - 1]);
+			if (needles[i].len > max)
+				max = needles[i].len;
+		}
+		// Stop when the longest needle cannot be loaded at all positions of a block
+		size_t reach = max - 1 + VEC_SIZE;
+		for (; reach <= size && pos <= size - reach; pos += VEC_SIZE) {
+			vec_t block = vec_load(p + pos);
+			uint64_t mask = 0;
+			for (int i = 0; i < num; ++i) {
+				vec_t tail = vec_load(p + pos + needles[i].len - 1);
+				mask |= vec_mask(vec_and(vec_eq(block, first[i]), vec_eq(tail, last[i])));
+			}
+			for (; mask; mask &= mask - 1) {
+				size_t off = pos + (__builtin_ctzll(mask) >> LANE_SHIFT);
+				for (int i = 0; i < num; ++i) {
+					if (match(p + off, size - off, needles[i])) {
+						if (which)
+							*which = i;
+						if (first != stack)
+							delete[] first;
+						return (void *) (p + off);
+					}
+				}
+			}
+		}
+		if (first != stack)
+			delete[] first;
+	}
+#endif
+
+	if (num == 1) {
+		// Let memchr skip to the first byte, it is heavily optimized in libc
+		uint8_t c = *(const uint8_t *) needles->buf;
+		for (const uint8_t *s; pos < size; ++pos) {
+			if ((s = (const uint8_t *) memchr(p + pos, c, size - pos)) == nullptr)
+				break;
+			pos = s - p;
+			if (match(s, size - pos, *needles)) {
+				if (which)
+					*which = 0;
+				return (void *) s;
+			}
+		}
+		return nullptr;
+	}
+
+	bool starts[256] = { false };
+	for (int i = 0; i < num; ++i)
+		starts[*(const uint8_t *) needles[i].buf] = true;
+	for (; pos < size; ++pos) {
+		if (!starts[p[pos]])
+			continue;
+		for (int i = 0; i < num; ++i) {
+			if (match(p + pos, size - pos, needles[i])) {
+				if (which)
+					*which = i;
+				return (void *) (p + pos);
+			}
+		}
+	}
+	return nullptr;
+}
+
+void *memfind(const void *buf, size_t size, const void *needle, size_t len) {
+	struct mem_needle n = { needle, len };
+	return memfind_any(buf, size, &n, 1, nullptr);
+}